@@ -4,18 +4,30 @@
 */
 
 #include "pin.H"
+#include <intrin.h>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
 #include <process.h>
 #include <sstream>
+#include <cstddef>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <unordered_map>
+namespace WINDOWS
+{
+#include <windows.h>
+#include <sddl.h>
+}
 
 /* ===================================================================== */
 // Command line switches
 /* ===================================================================== */
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "output", "console", "Specify a file name for output. Enter \".\" (without the quotes) to auto-generate the filename. If not specified, console is used.");
 KNOB<string> KnobModule(KNOB_MODE_WRITEONCE, "pintool", "module", "", "Specify the module to instrument (without file extension). Ex. -module kernel32");
-KNOB<bool> KnobNoSymbols(KNOB_MODE_WRITEONCE, "pintool", "no_symbols", "false", "Do not Load Symbols.");
+KNOB<bool> KnobNoSymbols(KNOB_MODE_WRITEONCE, "pintool", "no_symbols", "false", "Do not Load Symbols. Same as -symbols none.");
+KNOB<string> KnobSymbols(KNOB_MODE_WRITEONCE, "pintool", "symbols", "lazy", "Symbol loading: \"lazy\" has Pin read export symbols only (no PDBs) and names addresses from a module's export table the first time a name in it is needed, \"full\" also loads debug symbols for every module at startup, \"none\" loads nothing.");
 KNOB<bool> KnobNoResolveVirtualCalls(KNOB_MODE_WRITEONCE, "pintool", "no_resolve_virtual_calls", "false", "Don't resolve indirect calls.");
 KNOB<bool> KnobNoTrace(KNOB_MODE_WRITEONCE, "pintool", "no_trace", "false", "Don't trace basic blocks.");
 KNOB<bool> KnobAppend(KNOB_MODE_WRITEONCE, "pintool", "append", "false", "Do not include script header (appending to existing file).");
@@ -23,6 +35,21 @@ KNOB<bool> KnobVerbose(KNOB_MODE_WRITEONCE, "pintool", "verbose", "false", "Incl
 KNOB<bool> KnobNoConsole(KNOB_MODE_WRITEONCE, "pintool", "no_console", "false", "Do not output to console.");
 KNOB<bool> KnobDeferOutput(KNOB_MODE_WRITEONCE, "pintool", "defer_output", "false", "Defer output till process exit. Otherwise, live output from live process.");
 KNOB<string> KnobTraceColor(KNOB_MODE_WRITEONCE, "pintool", "trace_color", "0x7BF0D3", "The initial color (light green) for control flow tracing.");
+KNOB<string> KnobGranularity(KNOB_MODE_WRITEONCE, "pintool", "granularity", "bbl", "Coverage instrumentation: \"bbl\" makes one call per basic block, \"trace\" makes one call per trace exit and marks the executed prefix of the trace. Faster, but blocks of a trace left by a fault or exception are not marked.");
+KNOB<UINT32> KnobHeatThreshold(KNOB_MODE_WRITEONCE, "pintool", "heat_threshold", "0", "Executions after which a basic block is tagged hot and its instrumentation removed. 0 disables heat mode.");
+KNOB<string> KnobHeatColor(KNOB_MODE_WRITEONCE, "pintool", "heat_color", "0x7B7BF0", "The color (light red) for hot basic blocks.");
+KNOB<bool> KnobOrderedTrace(KNOB_MODE_WRITEONCE, "pintool", "ordered_trace", "false", "Record an ordered (thread, basic block, timestamp) execution trace to <output>.trace.");
+KNOB<UINT32> KnobOrderedTracePages(KNOB_MODE_WRITEONCE, "pintool", "ordered_trace_pages", "64", "Number of 4K pages in each thread's ordered trace buffer.");
+KNOB<UINT32> KnobOrderedTraceRing(KNOB_MODE_WRITEONCE, "pintool", "ordered_trace_ring", "256", "Number of most recent ordered trace records dumped on exception or signal.");
+KNOB<string> KnobPersistentFunction(KNOB_MODE_WRITEONCE, "pintool", "persistent_function", "", "Persistent mode: function re-entered for every input, as an export name or a module offset (0x...).");
+KNOB<string> KnobPersistentCorpus(KNOB_MODE_WRITEONCE, "pintool", "persistent_corpus", "", "Persistent mode: file listing one input path per line.");
+KNOB<string> KnobPersistentInput(KNOB_MODE_WRITEONCE, "pintool", "persistent_input", "", "Persistent mode: path the target reads its input from. Required with -persistent_function. Each corpus file is copied here before its iteration.");
+KNOB<bool> KnobLive(KNOB_MODE_WRITEONCE, "pintool", "live", "false", "Expose live coverage, resolved calls and stats in shared memory Local\\Ablation.Live.<pid>, and serve snapshot/reset/flush commands on \\\\.\\pipe\\ablation.<pid>.");
+KNOB<UINT32> KnobLiveCallTable(KNOB_MODE_WRITEONCE, "pintool", "live_call_table", "4096", "Number of resolved call targets the live shared memory region holds.");
+KNOB<bool> KnobCallGraph(KNOB_MODE_WRITEONCE, "pintool", "call_graph", "false", "Record the dynamic call graph (call counts and inclusive instruction counts) as xrefs and to <output>.callgrind.out.");
+KNOB<bool> KnobFollowChildren(KNOB_MODE_WRITEONCE, "pintool", "follow_children", "false", "Instrument child processes with the same options, each writing its own <output>.<pid> file. Requires Pin's -follow_execv.");
+KNOB<bool> KnobSharedCoverage(KNOB_MODE_WRITEONCE, "pintool", "shared_coverage", "false", "Merge the coverage of all followed processes in shared memory. The last process to exit writes <output>.merged.py, skipping processes that were killed.");
+KNOB<UINT32> KnobSharedCoverageRoot(KNOB_MODE_WRITEONCE, "pintool", "shared_coverage_root", "0", "(Internal) PID of the root process owning the shared coverage map, set for followed child processes.");
 
 /* ================================================================== */
 // Global variables 
@@ -30,6 +57,7 @@ KNOB<string> KnobTraceColor(KNOB_MODE_WRITEONCE, "pintool", "trace_color", "0x7B
 static string fileout;
 static UINT64 resolvedCount = 0;
 static std::ostream * out;
+static PIN_LOCK outputLock; // output() is called from analysis routines of any thread and from internal threads
 static string module;
 static ADDRINT imgBaseAddr = 0;
 static ADDRINT imgEndAddr = RSIZE_MAX; // 0x7FFFFFFF 32-bit or 0x7FFFFFFF'FFFFFFFF 64-bit
@@ -48,36 +76,259 @@ typedef struct VirtualCall
 
 static VirtualCall *virtualCallList = NULL;
 
+typedef std::pair<UINT32, string> ExportEntry; // (rva, name)
+
 typedef struct ModuleEntry
 {
 	ADDRINT _start;
 	ADDRINT _end;
 	string _name;
+	string _path;
+	bool _exportsLoaded;
+	std::vector<ExportEntry> _exports; // sorted by rva
 	struct ModuleEntry *_next;
 } ModuleEntry;
 
+struct ExportRvaLess
+{
+	bool operator()(UINT32 rva, const ExportEntry &entry) const
+	{
+		return rva < entry.first;
+	}
+};
+
+enum SymbolMode
+{
+	SYMBOLS_NONE,
+	SYMBOLS_LAZY,
+	SYMBOLS_FULL
+};
+
+static SymbolMode symbolMode = SYMBOLS_LAZY;
+static PIN_LOCK symbolLock;
+
 static ModuleEntry *moduleList = 0;
 
 typedef struct BblTrace
 {
 	ADDRINT _address;
+	UINT32 _size;
 	bool _marked;
+	bool _hot;
+	UINT64 _count;
+	UINT32 _iteration;
+	volatile long _liveGeneration; // liveGeneration when the block was last marked in the live region
 	struct BblTrace * _next;
 } BblTrace;
 BblTrace * bblTraceList = 0;
 
+/// <summary>
+/// The basic blocks of an instrumented trace, in trace order. An exit from block i means blocks 0..i ran.
+/// </summary>
+typedef struct TraceCoverage
+{
+	UINT32 _numBbls;
+	UINT32 _markedPrefix;
+	UINT32 _iteration;
+	long _liveGeneration;
+	BblTrace **_bbls;
+	struct TraceCoverage *_next;
+} TraceCoverage;
+static TraceCoverage *traceCoverageList = 0;
+static bool traceGranularity = false;
+
+// Persistent mode, the function is re-entered with a saved context for every corpus input
+static ADDRINT persistentAddr = 0;
+static volatile ADDRINT persistentSp = 0; // stack pointer at entry while an iteration runs, 0 otherwise
+static THREADID persistentTid = INVALID_THREADID;
+static CONTEXT persistentContext;
+static std::vector<string> persistentCorpus;
+static size_t persistentNext = 0;
+static UINT32 persistentIteration = 0;
+static std::vector<ADDRINT> iterationBbls;
+static PIN_LOCK persistentLock;
+static std::ofstream *persistentOut = 0;
+
+// Finds the BblTrace of a block again when its trace is reinstrumented
+static std::unordered_map<ADDRINT, BblTrace *> bblTraceIndex;
+static UINT64 hotCount = 0;
+
+/// <summary>
+/// A single ordered trace record, filled inline by Pin's trace buffer.
+/// </summary>
+typedef struct OrderedRecord
+{
+	UINT64 _timestamp;
+	UINT32 _tid;
+	UINT32 _offset;
+} OrderedRecord;
+
+/// <summary>
+/// A full trace buffer waiting for the writer thread.
+/// </summary>
+typedef struct OrderedChunk
+{
+	OrderedRecord *_records;
+	UINT64 _numRecords;
+	struct OrderedChunk *_next;
+} OrderedChunk;
+
+static string orderedTraceFile;
+static std::ofstream *orderedTraceOut = 0;
+static BUFFER_ID orderedTraceBuffer = BUFFER_ID_INVALID;
+static OrderedChunk *orderedChunkHead = 0;
+static OrderedChunk *orderedChunkTail = 0;
+static PIN_LOCK orderedTraceLock;
+static PIN_SEMAPHORE orderedTraceReady;
+static PIN_THREAD_UID orderedWriterUid;
+static volatile bool orderedWriterStop = false;
+static bool orderedFlushRequested = false;
+static bool orderedWriterDone = false;
+static OrderedRecord *orderedRing = 0;
+static std::vector<OrderedRecord *> orderedBufferBase; // Current buffer of each live thread, by THREADID
+static UINT64 orderedRingNext = 0;
+static UINT64 orderedRecordCount = 0;
+
+/// <summary>
+/// A call that has not returned yet, kept on a thread's shadow stack.
+/// </summary>
+typedef struct ShadowFrame
+{
+	ADDRINT _callSite;
+	ADDRINT _function;
+	ADDRINT _sp;
+	UINT64 _insCount;
+} ShadowFrame;
+
+/// <summary>
+/// Aggregated counts for one (call site, callee) edge.
+/// </summary>
+typedef struct CallEdge
+{
+	ADDRINT _callerFunction;
+	UINT64 _calls;
+	UINT64 _inclusive;
+} CallEdge;
+
+typedef std::pair<ADDRINT, ADDRINT> CallEdgeKey; // (call site, callee)
+
+struct CallEdgeKeyHash
+{
+	size_t operator()(const CallEdgeKey &key) const
+	{
+		return (size_t)(key.first * 31 + key.second);
+	}
+};
+
+typedef std::unordered_map<CallEdgeKey, CallEdge, CallEdgeKeyHash> CallEdgeMap;
+typedef std::unordered_map<ADDRINT, UINT64> FunctionCostMap; // function -> instructions executed in it (self)
+
+/// <summary>
+/// Per-thread call graph state.
+/// </summary>
+typedef struct CallGraphThread
+{
+	std::vector<ShadowFrame> _stack;
+	CallEdgeMap _edges;
+	FunctionCostMap _self;
+	UINT64 _insCount;
+	UINT64 _selfMark;          // _insCount when the current function was last credited
+	ADDRINT _rootFunction;     // the function calling from an empty shadow stack
+} CallGraphThread;
+
+static TLS_KEY callGraphKey = INVALID_TLS_KEY;
+static REG callGraphReg; // holds the thread's CallGraphThread, so the instruction count can be inlined
+static PIN_LOCK callGraphLock;
+static CallEdgeMap callGraph;
+static FunctionCostMap callGraphSelf;
+static UINT64 callGraphInstructions = 0;
+
+#define SHARED_COVERAGE_MAGIC 0x41424C54 // 'ABLT'
+#define SHARED_COVERAGE_MAX_PROCESSES 256
+
+static int pinArgc = 0;
+static char **pinArgv = 0;
+
+/// <summary>
+/// Layout of the coverage map shared by all followed processes. The bitmap (one bit per module byte) follows the header.
+/// </summary>
+typedef struct SharedCoverage
+{
+	UINT32 _magic;
+	UINT32 _bitmapSize;
+	volatile long _processes;
+	volatile long _merged;                            // set by the process that writes the merged script
+	volatile long _pids[SHARED_COVERAGE_MAX_PROCESSES]; // attached processes, 0 for a free slot
+	char _mergedFile[MAX_PATH];                       // full path of the merged script, set by the root
+} SharedCoverage;
+
+/// <summary>
+/// Layout of the live shared memory region of this process. The coverage bitmap (one bit per module byte)
+/// follows the header, then the resolved call table. Consumers map it read-only.
+/// </summary>
+typedef struct LiveHeader
+{
+	UINT32 _magic;
+	UINT32 _version;
+	UINT32 _pid;
+	UINT32 _bitmapSize;
+	UINT64 _moduleBase;
+	UINT64 _moduleSize;
+	UINT32 _callTableOffset;
+	UINT32 _callTableCapacity;
+	volatile long _callCount;
+	volatile long _sequence; // bumped by every command, stats below are as of the last snapshot
+	UINT64 _blocks;
+	UINT64 _resolvedCalls;
+	UINT64 _hotBlocks;
+	UINT64 _orderedRecords;
+	UINT64 _persistentInputs;
+} LiveHeader;
+
+/// <summary>
+/// A resolved call in the live region, as module offset and absolute target. _caller is written last.
+/// </summary>
+typedef struct LiveCall
+{
+	volatile UINT64 _target;
+	volatile UINT64 _caller;
+} LiveCall;
+
+#define LIVE_MAGIC 0x4C425441 // 'ATBL'
+
+static WINDOWS::HANDLE liveHandle = 0;
+static LiveHeader *live = 0;
+static volatile long *liveBitmap = 0;
+static LiveCall *liveCalls = 0;
+static volatile long liveBlocks = 0;
+static volatile long liveCallReserved = 0;
+static string livePipeName;
+static PIN_THREAD_UID liveServerUid;
+static volatile bool liveStop = false;
+static bool liveServerStarted = false;
+static volatile long liveGeneration = 0; // bumped by reset, blocks are marked again in the live region when they next run
+
+static string sharedCoverageFile;
+static WINDOWS::HANDLE sharedCoverageHandle = 0;
+static SharedCoverage *sharedCoverage = 0;
+static volatile long *sharedCoverageBitmap = 0;
+
 /// <summary>
 /// Writes s to the output stream. If the output stream is not cout, and the -no_console option was not specified, output s to cout.
 /// </summary>
 /// <param name="s">The s.</param>
 static void output(string s)
 {
+	PIN_GetLock(&outputLock, PIN_ThreadId() + 1);
+
 	// Writes s to the output stream.
 	*out << s;
 
 	// If the output stream is not cout, and the -no_console option was not specified, output s to cout.
 	if (!KnobNoConsole.Value() && out != &cout)
 		cout << s;
+
+	PIN_ReleaseLock(&outputLock);
 }
 
 /// <summary>
@@ -134,189 +385,1793 @@ static string ToLower(string str)
 }
 
 /// <summary>
-/// Strips the path from a filename.
+/// Strips the path from a filename.
+/// </summary>
+/// <param name="filename">The filename.</param>
+/// <returns>The filename without the path.</returns>
+static string StripPath(string filename)
+{
+	size_t index = filename.find_last_of("/\\");
+
+	if (index >= 0)
+		return filename.substr(index + 1, 0x100);
+	return filename;
+}
+
+/// <summary>
+/// Parses the filename without the extension.
+/// </summary>
+/// <param name="filename">The filename.</param>
+/// <returns>Filename without extension.</returns>
+static string FilenameWithoutExtension(string filename)
+{
+	size_t index = filename.find_last_of('.');
+
+	if (index >= 0)
+		return filename.substr(0, index);
+	return filename;
+}
+
+/// <summary>
+/// Gets the name of a file written next to the output, e.g. the ordered trace.
+/// </summary>
+/// <param name="ext">The extension, with its dot.</param>
+static string OutputSidecarName(string ext)
+{
+	return (out == &cout ? module + ".ablation" : FilenameWithoutExtension(fileout)) + ext;
+}
+
+/// <summary>
+/// Gets the entry of the module that contains address.
+/// </summary>
+/// <param name="address">The address.</param>
+static ModuleEntry *GetModuleEntry(ADDRINT address)
+{
+	for (ModuleEntry *mod = moduleList; mod != 0; mod = mod->_next)
+	{
+		if (mod->_start <= address && mod->_end > address)
+			return mod;
+	}
+
+	return 0;
+}
+
+/// <summary>
+/// Formats a module table line, used by offline converters to rebase the output.
+/// </summary>
+/// <param name="entry">The module entry.</param>
+static string ModuleEntryLine(ModuleEntry *entry)
+{
+	std::ostringstream ss;
+	ss << setfill('0');
+
+	ss << "# MODULE: 0x" << setw(8) << hex << entry->_start << " 0x" << setw(8) << hex << entry->_end << " \"" << entry->_name << "\" " << entry->_path << endl;
+	return ss.str();
+}
+
+/// <summary>
+/// Outputs a module table line.
+/// </summary>
+/// <param name="entry">The module entry.</param>
+static void OutputModuleEntry(ModuleEntry *entry)
+{
+	output(ModuleEntryLine(entry));
+}
+
+/// <summary>
+/// Reads the PE headers of a module from memory.
+/// </summary>
+/// <param name="mod">The module.</param>
+/// <param name="nt">Receives the NT headers.</param>
+/// <returns>true if the module has valid PE headers.</returns>
+static bool ReadNtHeaders(ModuleEntry *mod, WINDOWS::IMAGE_NT_HEADERS *nt)
+{
+	WINDOWS::IMAGE_DOS_HEADER dos;
+	if (PIN_SafeCopy(&dos, (VOID *)mod->_start, sizeof(dos)) != sizeof(dos) || dos.e_magic != IMAGE_DOS_SIGNATURE)
+		return false;
+
+	if (PIN_SafeCopy(nt, (VOID *)(mod->_start + dos.e_lfanew), sizeof(*nt)) != sizeof(*nt) || nt->Signature != IMAGE_NT_SIGNATURE)
+		return false;
+
+	return true;
+}
+
+/// <summary>
+/// Reads the export table of a module from memory.
+/// </summary>
+/// <param name="mod">The module.</param>
+/// <param name="nt">The NT headers of the module.</param>
+static void ReadExports(ModuleEntry *mod, const WINDOWS::IMAGE_NT_HEADERS &nt)
+{
+	WINDOWS::IMAGE_DATA_DIRECTORY dir = nt.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+	if (dir.VirtualAddress == 0)
+		return;
+
+	WINDOWS::IMAGE_EXPORT_DIRECTORY exports;
+	if (PIN_SafeCopy(&exports, (VOID *)(mod->_start + dir.VirtualAddress), sizeof(exports)) != sizeof(exports))
+		return;
+
+	std::vector<UINT32> functions(exports.NumberOfFunctions);
+	std::vector<UINT32> names(exports.NumberOfNames);
+	std::vector<UINT16> ordinals(exports.NumberOfNames);
+	if (functions.empty() || names.empty())
+		return;
+
+	PIN_SafeCopy(&functions[0], (VOID *)(mod->_start + exports.AddressOfFunctions), functions.size() * sizeof(UINT32));
+	PIN_SafeCopy(&names[0], (VOID *)(mod->_start + exports.AddressOfNames), names.size() * sizeof(UINT32));
+	PIN_SafeCopy(&ordinals[0], (VOID *)(mod->_start + exports.AddressOfNameOrdinals), ordinals.size() * sizeof(UINT16));
+
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (ordinals[i] >= functions.size())
+			continue;
+
+		UINT32 rva = functions[ordinals[i]];
+
+		// Forwarders point back into the export directory, they are not code
+		if (rva >= dir.VirtualAddress && rva < dir.VirtualAddress + dir.Size)
+			continue;
+
+		char name[0x100];
+		size_t copied = PIN_SafeCopy(name, (VOID *)(mod->_start + names[i]), sizeof(name) - 1);
+		name[copied] = 0;
+
+		if (name[0] != 0)
+			mod->_exports.push_back(ExportEntry(rva, string(name)));
+	}
+}
+
+/// <summary>
+/// Loads the export table of a module.
+/// </summary>
+/// <param name="mod">The module.</param>
+static void LoadExports(ModuleEntry *mod)
+{
+	mod->_exportsLoaded = true;
+
+	WINDOWS::IMAGE_NT_HEADERS nt;
+	if (!ReadNtHeaders(mod, &nt))
+		return;
+
+	ReadExports(mod, nt);
+	std::sort(mod->_exports.begin(), mod->_exports.end());
+}
+
+/// <summary>
+/// Finds the name of the routine containing address. In lazy mode the export table of the module is loaded the first time it is needed.
+/// </summary>
+/// <param name="address">The address.</param>
+/// <returns>The routine name, "export+0xoffset" for addresses past an export, or empty if unknown.</returns>
+static string SymbolNameByAddress(ADDRINT address)
+{
+	if (symbolMode == SYMBOLS_FULL)
+		return RTN_FindNameByAddress(address);
+
+	if (symbolMode == SYMBOLS_NONE)
+		return "";
+
+	string name;
+
+	PIN_GetLock(&symbolLock, PIN_ThreadId() + 1);
+
+	ModuleEntry *mod = GetModuleEntry(address);
+	if (mod != 0)
+	{
+		if (!mod->_exportsLoaded)
+			LoadExports(mod);
+
+		// Closest export at or below the address
+		UINT32 rva = (UINT32)(address - mod->_start);
+		std::vector<ExportEntry>::const_iterator it = std::upper_bound(mod->_exports.begin(), mod->_exports.end(), rva, ExportRvaLess());
+		if (it != mod->_exports.begin())
+		{
+			--it;
+
+			std::ostringstream ss;
+			ss << it->second;
+			if (rva != it->first)
+				ss << "+0x" << hex << (rva - it->first);
+			name = ss.str();
+		}
+	}
+
+	PIN_ReleaseLock(&symbolLock);
+
+	return name;
+}
+
+/// <summary>
+/// Invalidates the code cache outside of the desired module.
+/// </summary>
+static void InvalidateTraceExternal()
+{
+	UINT32 invalidated = CODECACHE_InvalidateRange(0, imgBaseAddr);
+	invalidated += CODECACHE_InvalidateRange(imgEndAddr, RSIZE_MAX);
+
+	if (invalidated > 0 && KnobVerbose.Value())
+	{
+		std::ostringstream ss;
+		ss << setfill('0');
+		ss << "# Invalidated " << hex << invalidated << " traces" << endl << flush;
+		output(ss.str());
+	}
+}
+
+/// <summary>
+/// Filters the trace by constraining to addresses within the module specified on the command-line.
+/// </summary>
+/// <param name="trace">The trace.</param>
+/// <returns></returns>
+static bool FilterTrace(TRACE trace)
+{
+	if (!imgBaseAddr || !imgEndAddr)
+		return false;
+
+	if (TRACE_Address(trace) < imgBaseAddr || TRACE_Address(trace) > imgEndAddr)
+		return false;
+
+	return true;
+}
+
+/// <summary>
+/// Creates (or opens) and maps a named shared memory section.
+/// </summary>
+/// <param name="name">The section name.</param>
+/// <param name="size">The size.</param>
+/// <param name="readOnly">Other processes may only map the section for reading. This process keeps write access through its handle.</param>
+/// <param name="handle">Receives the section handle.</param>
+/// <returns>The view, or 0 on failure.</returns>
+static VOID *MapSharedSection(const string &name, UINT32 size, bool readOnly, WINDOWS::HANDLE *handle)
+{
+	WINDOWS::SECURITY_ATTRIBUTES sa;
+	WINDOWS::PSECURITY_DESCRIPTOR sd = 0;
+
+	// Protected DACL granting read to everyone. The OWNER RIGHTS entry keeps the owner from rewriting the DACL to get write access.
+	if (readOnly && !WINDOWS::ConvertStringSecurityDescriptorToSecurityDescriptorA("D:P(A;;GR;;;WD)(A;;GR;;;OW)", SDDL_REVISION_1, &sd, 0))
+	{
+		cerr << "Error: could not create the security descriptor of " << name << endl;
+		*handle = 0;
+		return 0;
+	}
+
+	sa.nLength = sizeof(sa);
+	sa.lpSecurityDescriptor = sd;
+	sa.bInheritHandle = FALSE;
+
+	*handle = WINDOWS::CreateFileMappingA((WINDOWS::HANDLE)(WINDOWS::LONG_PTR)-1, readOnly ? &sa : 0, PAGE_READWRITE, 0, size, name.c_str());
+
+	if (sd != 0)
+		WINDOWS::LocalFree(sd);
+
+	if (*handle == 0)
+	{
+		cerr << "Error: could not create shared memory " << name << endl;
+		return 0;
+	}
+
+	VOID *view = WINDOWS::MapViewOfFile(*handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (view == 0)
+	{
+		cerr << "Error: could not map shared memory " << name << endl;
+		WINDOWS::CloseHandle(*handle);
+		*handle = 0;
+	}
+
+	return view;
+}
+
+/// <summary>
+/// Gets the size of a coverage bitmap of the instrumented module: whole 32 bit words, one bit per byte of the module.
+/// </summary>
+static UINT32 CoverageBitmapSize()
+{
+	return (UINT32)(((imgEndAddr - imgBaseAddr + 1) + 31) / 32 * 4);
+}
+
+/// <summary>
+/// Sets the coverage bit of address in a shared bitmap. Safe to call concurrently from any process.
+/// </summary>
+/// <param name="bitmap">The bitmap, or 0 if it is not mapped.</param>
+/// <param name="bitmapSize">The bitmap size in bytes.</param>
+/// <param name="address">The address.</param>
+/// <returns>true if the bit was set.</returns>
+static bool MarkCoverage(volatile long *bitmap, UINT32 bitmapSize, ADDRINT address)
+{
+	ADDRINT offset = address - imgBaseAddr;
+
+	if (bitmap == 0 || offset / 8 >= bitmapSize)
+		return false;
+
+	_InterlockedOr(&bitmap[offset / 32], (long)(1u << (offset % 32)));
+	return true;
+}
+
+/// <summary>
+/// Appends a resolved call to the live call table, while there is room.
+/// </summary>
+/// <param name="caller">The caller.</param>
+/// <param name="target">The target.</param>
+static void AddLiveCall(ADDRINT caller, ADDRINT target)
+{
+	if (live == 0)
+		return;
+
+	long index = _InterlockedIncrement(&liveCallReserved) - 1;
+	if ((UINT32)index >= live->_callTableCapacity)
+		return;
+
+	liveCalls[index]._target = target;
+	liveCalls[index]._caller = caller - imgBaseAddr;
+	_InterlockedIncrement(&live->_callCount);
+}
+
+/// <summary>
+/// Copies the stats counters into the live region.
+/// </summary>
+static void LiveSnapshot()
+{
+	live->_blocks = (UINT32)liveBlocks;
+	live->_resolvedCalls = resolvedCount;
+	live->_hotBlocks = hotCount;
+	live->_orderedRecords = orderedRecordCount;
+	live->_persistentInputs = persistentNext;
+}
+
+/// <summary>
+/// Clears the live coverage. Blocks are reinstrumented so they are marked in the live region again when they next run.
+/// </summary>
+static void LiveReset()
+{
+	PIN_LockClient();
+
+	// Only the live view starts over, the tool's own coverage (and its output) is untouched
+	memset((void *)liveBitmap, 0, live->_bitmapSize);
+	liveBlocks = 0;
+	_InterlockedIncrement(&liveGeneration);
+
+	PIN_RemoveInstrumentationInRange(imgBaseAddr, imgEndAddr);
+
+	PIN_UnlockClient();
+}
+
+/// <summary>
+/// Flushes the output files. Persistent mode flushes every input's record itself.
+/// </summary>
+static void LiveFlush()
+{
+	PIN_GetLock(&outputLock, PIN_ThreadId() + 1);
+	out->flush();
+	PIN_ReleaseLock(&outputLock);
+
+	if (orderedTraceOut)
+	{
+		// The writer thread owns the trace stream. Once it is gone, OrderedBufferFull writes under the lock.
+		PIN_GetLock(&orderedTraceLock, PIN_ThreadId() + 1);
+		if (orderedWriterDone)
+		{
+			orderedTraceOut->flush();
+		}
+		else
+		{
+			orderedFlushRequested = true;
+			PIN_SemaphoreSet(&orderedTraceReady);
+		}
+		PIN_ReleaseLock(&orderedTraceLock);
+	}
+}
+
+/// <summary>
+/// Executes a command received on the live pipe.
+/// </summary>
+/// <param name="command">The command.</param>
+/// <returns>The reply.</returns>
+static string LiveCommand(const string &command)
+{
+	std::ostringstream ss;
+
+	if (command.compare("snapshot") == 0)
+		LiveSnapshot();
+	else if (command.compare("reset") == 0)
+		LiveReset();
+	else if (command.compare("flush") == 0)
+		LiveFlush();
+	else
+		return "ERROR unknown command " + command + "\n";
+
+	long sequence = _InterlockedIncrement(&live->_sequence);
+
+	ss << "OK " << command << " sequence=" << dec << sequence
+		<< " blocks=" << live->_blocks
+		<< " calls=" << live->_resolvedCalls
+		<< " hot=" << live->_hotBlocks
+		<< " records=" << live->_orderedRecords
+		<< " inputs=" << live->_persistentInputs << endl;
+	return ss.str();
+}
+
+/// <summary>
+/// Internal thread serving the live command pipe, one client at a time.
+/// </summary>
+static VOID LiveServer(VOID *arg)
+{
+	while (!liveStop)
+	{
+		WINDOWS::HANDLE pipe = WINDOWS::CreateNamedPipeA(livePipeName.c_str(), PIPE_ACCESS_DUPLEX,
+			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT, 1, 0x1000, 0x1000, 0, 0);
+		if (pipe == (WINDOWS::HANDLE)(WINDOWS::LONG_PTR)-1)
+		{
+			cerr << "Error: could not create " << livePipeName << endl;
+			break;
+		}
+
+		if (WINDOWS::ConnectNamedPipe(pipe, 0) || WINDOWS::GetLastError() == ERROR_PIPE_CONNECTED)
+		{
+			char buffer[0x100];
+			WINDOWS::DWORD read, written;
+
+			while (!liveStop && WINDOWS::ReadFile(pipe, buffer, sizeof(buffer) - 1, &read, 0) && read > 0)
+			{
+				// Commands may end with a newline
+				while (read > 0 && (buffer[read - 1] == '\n' || buffer[read - 1] == '\r'))
+					read--;
+				buffer[read] = 0;
+
+				string reply = LiveCommand(string(buffer));
+				WINDOWS::WriteFile(pipe, reply.c_str(), (WINDOWS::DWORD)reply.length(), &written, 0);
+			}
+		}
+
+		WINDOWS::DisconnectNamedPipe(pipe);
+		WINDOWS::CloseHandle(pipe);
+	}
+}
+
+/// <summary>
+/// Stops the live server before Pin terminates internal threads.
+/// </summary>
+static VOID LivePrepareForFini(VOID *v)
+{
+	// The target module never loaded, or the server failed to start
+	if (!liveServerStarted)
+		return;
+
+	liveStop = true;
+
+	// Unblock a server waiting for a client
+	WINDOWS::HANDLE pipe = WINDOWS::CreateFileA(livePipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
+	if (pipe != (WINDOWS::HANDLE)(WINDOWS::LONG_PTR)-1)
+		WINDOWS::CloseHandle(pipe);
+
+	// A client that stays connected without sending anything must not hang the exit
+	PIN_WaitForThreadTermination(liveServerUid, 1000, 0);
+}
+
+/// <summary>
+/// Creates the live region for the instrumented module and starts the command pipe server.
+/// </summary>
+static void InitLive()
+{
+	std::ostringstream ss;
+	ss << "Local\\Ablation.Live." << dec << _getpid();
+
+	UINT32 bitmapSize = CoverageBitmapSize();
+	UINT32 capacity = KnobLiveCallTable.Value();
+	UINT32 callTableOffset = (UINT32)sizeof(LiveHeader) + bitmapSize;
+	UINT32 size = callTableOffset + capacity * (UINT32)sizeof(LiveCall);
+
+	live = (LiveHeader *)MapSharedSection(ss.str(), size, true, &liveHandle);
+	if (live == 0)
+		return;
+
+	live->_version = 1;
+	live->_pid = _getpid();
+	live->_bitmapSize = bitmapSize;
+	live->_moduleBase = imgBaseAddr;
+	live->_moduleSize = imgEndAddr - imgBaseAddr + 1;
+	live->_callTableOffset = callTableOffset;
+	live->_callTableCapacity = capacity;
+	liveBitmap = (volatile long *)(live + 1);
+	liveCalls = (LiveCall *)((char *)live + callTableOffset);
+	liveGeneration = 1; // blocks start at 0, so every block is marked the first time it runs
+	live->_magic = LIVE_MAGIC; // last, consumers wait for it
+
+	ss.str("");
+	ss << "\\\\.\\pipe\\ablation." << dec << _getpid();
+	livePipeName = ss.str();
+
+	if (PIN_SpawnInternalThread(LiveServer, 0, 0, &liveServerUid) == INVALID_THREADID)
+	{
+		cerr << "Error: could not start the live server thread." << endl;
+		return;
+	}
+	liveServerStarted = true;
+
+	if (KnobVerbose.Value())
+		output("# Live coverage on " + livePipeName + "\n");
+}
+
+/// <summary>
+/// Outputs virtual calls as script.
+/// </summary>
+/// <param name="caller">The caller.</param>
+/// <param name="target">The target.</param>
+static void OutputVirtualCall(ADDRINT caller, ADDRINT target)
+{
+	std::ostringstream ss;
+	ss << setfill('0');
+
+	if (target >= imgBaseAddr && target < imgEndAddr) // Target is within current module
+	{
+		ss << "createXRef(0x" << setw(8) << hex << (caller - imgBaseAddr) << ", 0x" << setw(8) << hex << (target - imgBaseAddr) << ")";
+		
+	}
+	else // Target is outside of the current module
+	{
+	
+		ModuleEntry *entry = GetModuleEntry(target);
+		ss << "createXRefExternal(0x" << setw(8) << hex << (caller - imgBaseAddr) << ", \"" 
+			<< (entry == 0 ? string("__unk__") : entry->_name) 
+			<< "!" 
+			<< SymbolNameByAddress(target) << " "
+			<< hex << target << "\")";
+
+		if (KnobVerbose.Value())
+			ss << "\t# " << setw(8) << hex << target - entry->_start;
+	}
+
+	ss << endl;
+	output(ss.str());
+}
+
+/// <summary>
+/// Prints all resolved virtual calls for a caller.
+/// </summary>
+/// <param name="vcall">The vcall.</param>
+static void OutputResolvedVirtualCall(VirtualCall *vcall)
+{
+	for (int i = 0; i < vcall->_numTargets; i++)
+	{
+		OutputVirtualCall(vcall->_caller, vcall->_targets[i]);
+	}
+}
+
+/// <summary>
+/// Resolves the virtual call.
+/// </summary>
+/// <param name="target">The target.</param>
+/// <param name="vcallList">The vcall list.</param>
+static void ResolveVirtualCall(ADDRINT target, VirtualCall *vcallList)
+{
+	if (vcallList->_numTargets > 0x40) // Only allow a max of 64 Virtual Calls to be resolved (avoids building a massive list when JIT code is constantly being cycled)
+		return;
+
+	// Check that we haven't already resolved this target for this caller
+	for (int i = 0; i < vcallList->_numTargets; i++)
+	{
+		if (vcallList->_targets[i] == target)
+			return;
+	}
+
+	vcallList->_numTargets++;
+	vcallList->_targets = (ADDRINT *)realloc(vcallList->_targets, vcallList->_numTargets * sizeof(void *));
+	vcallList->_targets[vcallList->_numTargets - 1] = target;
+	resolvedCount++; // Increment global counter
+	AddLiveCall(vcallList->_caller, target);
+
+	if (!KnobDeferOutput.Value())
+		OutputVirtualCall(vcallList->_caller, target);
+}
+
+/// <summary>
+/// Outputs the marked BBL as scrupt.
+/// </summary>
+/// <param name="bb">The bb.</param>
+static void OutputMarkedBbl(BblTrace *bb)
+{
+	if (!bb->_marked)
+		return;
+
+	std::ostringstream ss;
+	ss << setfill('0');
+
+	ss << "mark(0x" << setw(8) << hex << (bb->_address - imgBaseAddr) << ", 0x" << hex << bb->_size << ")";
+	if (KnobVerbose.Value())
+	{
+		ModuleEntry *mod = GetModuleEntry(bb->_address);
+		ss << "\t# " << (mod == 0 ? string("__unk__") : mod->_name) << "!" << SymbolNameByAddress(bb->_address);
+	}
+	ss << endl;
+
+	bbcount++;
+
+	output(ss.str());
+}
+
+static string ScriptHeader();
+
+/// <summary>
+/// Gives a process a slot in the shared coverage map, reusing the slot its parent reserved for it.
+/// </summary>
+/// <param name="pid">The process id.</param>
+static void ClaimSharedCoverageSlot(long pid)
+{
+	for (UINT32 i = 0; i < SHARED_COVERAGE_MAX_PROCESSES; i++)
+	{
+		if (sharedCoverage->_pids[i] == pid)
+			return;
+	}
+
+	// Processes beyond the slot count still contribute coverage, but the merged script may be written before they exit
+	for (UINT32 i = 0; i < SHARED_COVERAGE_MAX_PROCESSES; i++)
+	{
+		if (_InterlockedCompareExchange(&sharedCoverage->_pids[i], pid, 0) == 0)
+			return;
+	}
+}
+
+/// <summary>
+/// Opens the coverage map shared with the root process, or creates it if this is the root.
+/// </summary>
+static void AttachSharedCoverage()
+{
+	std::ostringstream ss;
+
+	UINT32 root = KnobSharedCoverageRoot.Value() != 0 ? KnobSharedCoverageRoot.Value() : _getpid();
+	ss << "Local\\Ablation." << dec << root << "." << module;
+
+	UINT32 bitmapSize = CoverageBitmapSize();
+	UINT32 size = sizeof(SharedCoverage) + bitmapSize;
+
+	// Followed processes open the same section and write to it
+	sharedCoverage = (SharedCoverage *)MapSharedSection(ss.str(), size, false, &sharedCoverageHandle);
+	if (sharedCoverage == 0)
+		return;
+
+	// A new mapping is zero filled, so only the first process sees a zero magic
+	if (_InterlockedCompareExchange((volatile long *)&sharedCoverage->_magic, SHARED_COVERAGE_MAGIC, 0) == 0)
+	{
+		sharedCoverage->_bitmapSize = bitmapSize;
+
+		// Children may run in another directory, so they get the root's full path
+		if (WINDOWS::GetFullPathNameA(sharedCoverageFile.c_str(), MAX_PATH, sharedCoverage->_mergedFile, 0) == 0)
+			strncpy(sharedCoverage->_mergedFile, sharedCoverageFile.c_str(), MAX_PATH - 1);
+
+		// A child only creates the map when the root never had one (the module did not load in it) or it is gone.
+		// Its coverage is in its own output, it must not replace the merged script with a partial one.
+		if (root != (UINT32)_getpid())
+		{
+			sharedCoverage->_merged = 1;
+			cerr << "Warning: shared coverage map of process " << dec << root << " not found, not merging the coverage of this process." << endl;
+		}
+	}
+
+	ClaimSharedCoverageSlot(_getpid());
+	_InterlockedIncrement(&sharedCoverage->_processes);
+	sharedCoverageBitmap = (volatile long *)(sharedCoverage + 1);
+
+	if (KnobVerbose.Value())
+	{
+		ss << " attached" << endl;
+		output("# Shared coverage map " + ss.str());
+	}
+}
+
+/// <summary>
+/// Checks whether a process is still running.
+/// </summary>
+/// <param name="pid">The process id.</param>
+static bool ProcessAlive(UINT32 pid)
+{
+	WINDOWS::HANDLE process = WINDOWS::OpenProcess(SYNCHRONIZE, FALSE, pid);
+	if (process == 0)
+		return false;
+
+	bool alive = WINDOWS::WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	WINDOWS::CloseHandle(process);
+	return alive;
+}
+
+/// <summary>
+/// Detaches from the shared coverage map. The last process to detach writes the merged coverage script.
+/// Processes that were killed without detaching are skipped, as their slot belongs to a process that is gone.
+/// </summary>
+static void DetachSharedCoverage()
+{
+	if (sharedCoverage == 0)
+		return;
+
+	long self = _getpid();
+	for (UINT32 i = 0; i < SHARED_COVERAGE_MAX_PROCESSES; i++)
+		_InterlockedCompareExchange(&sharedCoverage->_pids[i], 0, self);
+
+	// Every process frees its slot before looking at the others, so the last one to exit sees no live process
+	bool last = true;
+	for (UINT32 i = 0; i < SHARED_COVERAGE_MAX_PROCESSES && last; i++)
+	{
+		long pid = sharedCoverage->_pids[i];
+		if (pid != 0 && ProcessAlive(pid))
+			last = false;
+	}
+
+	if (last && _InterlockedCompareExchange(&sharedCoverage->_merged, 1, 0) == 0)
+	{
+		std::ostringstream ss;
+		ss << setfill('0');
+
+		ss << ScriptHeader();
+		ss << "# Merged coverage of " << dec << sharedCoverage->_processes << " processes" << endl;
+
+		ModuleEntry *entry = GetModuleEntry(imgBaseAddr);
+		if (entry != 0)
+		{
+			ss << ModuleEntryLine(entry);
+			ss << "# TARGET: " << entry->_name << endl;
+		}
+
+		for (UINT32 word = 0; word < sharedCoverage->_bitmapSize / 4; word++)
+		{
+			UINT32 bits = (UINT32)sharedCoverageBitmap[word];
+			for (UINT32 bit = 0; bits != 0; bit++, bits >>= 1)
+			{
+				if (bits & 1)
+					ss << "mark(0x" << setw(8) << hex << (word * 32 + bit) << ")" << endl;
+			}
+		}
+
+		std::ofstream merged(sharedCoverage->_mergedFile, fstream::out | fstream::trunc);
+		merged << ss.str();
+	}
+
+	WINDOWS::UnmapViewOfFile((WINDOWS::LPCVOID)sharedCoverage);
+	WINDOWS::CloseHandle(sharedCoverageHandle);
+	sharedCoverage = 0;
+	sharedCoverageBitmap = 0;
+}
+
+/// <summary>
+/// Called when the application creates a child process. Propagates this tool's knobs to the child,
+/// pointing it at the shared coverage map of the root process.
+/// </summary>
+/// <param name="child">The child process.</param>
+/// <param name="v">The v argument (optional).</param>
+/// <returns>TRUE to instrument the child.</returns>
+static BOOL FollowChild(CHILD_PROCESS child, VOID *v)
+{
+	std::vector<string> args;
+
+	// Pin, its options, the tool and its knobs, without the application command line
+	for (int i = 0; i < pinArgc && string(pinArgv[i]).compare("--") != 0; i++)
+	{
+		if (string(pinArgv[i]).compare("-shared_coverage_root") == 0)
+		{
+			i++; // replaced below
+			continue;
+		}
+		args.push_back(pinArgv[i]);
+	}
+
+	if (KnobSharedCoverage.Value())
+	{
+		std::ostringstream ss;
+		ss << dec << (KnobSharedCoverageRoot.Value() != 0 ? KnobSharedCoverageRoot.Value() : _getpid());
+
+		args.push_back("-shared_coverage_root");
+		args.push_back(ss.str());
+	}
+
+	args.push_back("--");
+
+	if (sharedCoverage != 0)
+	{
+		UINT32 pid = CHILD_PROCESS_GetId(child);
+
+		// The child counts as alive before its module loads, so the merged script waits for it
+		ClaimSharedCoverageSlot(pid);
+
+		// A parent that exits first (e.g. a launcher) must not take the map down with it, the child holds a handle too
+		WINDOWS::HANDLE process = WINDOWS::OpenProcess(PROCESS_DUP_HANDLE, FALSE, pid);
+		if (process != 0)
+		{
+			WINDOWS::HANDLE duplicate;
+			WINDOWS::DuplicateHandle(WINDOWS::GetCurrentProcess(), sharedCoverageHandle, process, &duplicate, 0, FALSE, DUPLICATE_SAME_ACCESS);
+			WINDOWS::CloseHandle(process);
+		}
+	}
+
+	std::vector<const CHAR *> childArgv;
+	for (size_t i = 0; i < args.size(); i++)
+		childArgv.push_back(args[i].c_str());
+
+	CHILD_PROCESS_SetPinCommandLine(child, (INT)childArgv.size(), &childArgv[0]);
+
+	if (KnobVerbose.Value())
+	{
+		std::ostringstream ss;
+		ss << "# Following child process " << dec << CHILD_PROCESS_GetId(child) << endl;
+		output(ss.str());
+	}
+
+	return TRUE;
+}
+
+/// <summary>
+/// Logs the BBL execution.
+/// </summary>
+/// <param name="bb">The bb.</param>
+static void LogBbl(BblTrace *bb)
+{
+	// Per input coverage in persistent mode
+	if (persistentSp != 0 && bb->_iteration != persistentIteration)
+	{
+		PIN_GetLock(&persistentLock, PIN_ThreadId() + 1);
+		if (bb->_iteration != persistentIteration)
+		{
+			bb->_iteration = persistentIteration;
+			iterationBbls.push_back(bb->_address);
+		}
+		PIN_ReleaseLock(&persistentLock);
+	}
+
+	// Live coverage since the last reset, independent of the tool's own marks
+	long generation = liveGeneration;
+	if (live != 0 && bb->_liveGeneration != generation && _InterlockedExchange(&bb->_liveGeneration, generation) != generation)
+	{
+		if (MarkCoverage(liveBitmap, live->_bitmapSize, bb->_address))
+			_InterlockedIncrement(&liveBlocks);
+	}
+
+	if (bb->_marked)
+		return;
+
+	bb->_marked = true;
+	if (sharedCoverage != 0)
+		MarkCoverage(sharedCoverageBitmap, sharedCoverage->_bitmapSize, bb->_address);
+
+	if (!KnobDeferOutput.Value())
+		OutputMarkedBbl(bb);
+}
+
+/// <summary>
+/// Outputs the hot BBL as script.
+/// </summary>
+/// <param name="bb">The bb.</param>
+static void OutputHotBbl(BblTrace *bb)
+{
+	if (!bb->_hot)
+		return;
+
+	std::ostringstream ss;
+	ss << setfill('0');
+
+	ss << "hot(0x" << setw(8) << hex << (bb->_address - imgBaseAddr) << ", 0x" << hex << bb->_size << ")";
+	if (KnobVerbose.Value())
+	{
+		ModuleEntry *mod = GetModuleEntry(bb->_address);
+		ss << "\t# " << (mod == 0 ? string("__unk__") : mod->_name) << "!" << SymbolNameByAddress(bb->_address);
+	}
+	ss << endl;
+
+	output(ss.str());
+}
+
+/// <summary>
+/// Counts a BBL execution. Inlined by Pin, the Then call only runs once the block crosses the threshold.
+/// </summary>
+/// <param name="bb">The bb.</param>
+/// <param name="threshold">The heat threshold.</param>
+/// <returns>Non-zero once the block is hot.</returns>
+static ADDRINT PIN_FAST_ANALYSIS_CALL CountBbl(BblTrace *bb, UINT32 threshold)
+{
+	return ++bb->_count >= threshold;
+}
+
+/// <summary>
+/// Tags the BBL hot and removes its instrumentation, PrintTrace reinstruments it without the counter.
+/// </summary>
+/// <param name="bb">The bb.</param>
+static VOID HotBbl(BblTrace *bb)
+{
+	if (bb->_hot)
+		return;
+
+	bb->_hot = true;
+	hotCount++;
+
+	if (!KnobDeferOutput.Value())
+		OutputHotBbl(bb);
+
+	// Takes effect once the current trace exits
+	PIN_RemoveInstrumentationInRange(bb->_address, bb->_address + bb->_size - 1);
+}
+
+/// <summary>
+/// Gets the BblTrace for a BBL, creating it the first time the BBL is instrumented.
+/// </summary>
+/// <param name="bbl">The bbl.</param>
+static BblTrace *GetBblTrace(BBL bbl)
+{
+	std::unordered_map<ADDRINT, BblTrace *>::iterator it = bblTraceIndex.find(BBL_Address(bbl));
+	if (it != bblTraceIndex.end())
+		return it->second;
+
+	BblTrace * bb = new BblTrace;
+	bb->_address = BBL_Address(bbl);
+	bb->_size = BBL_Size(bbl);
+	bb->_marked = false;
+	bb->_hot = false;
+	bb->_count = 0;
+	bb->_iteration = 0;
+	bb->_liveGeneration = 0;
+	bb->_next = bblTraceList;
+	bblTraceList = bb;
+
+	bblTraceIndex[bb->_address] = bb;
+	return bb;
+}
+
+/// <summary>
+/// Checks whether a trace exit leaves unmarked blocks behind. Inlined by Pin.
+/// </summary>
+/// <param name="tc">The trace coverage.</param>
+/// <param name="prefix">Number of blocks executed when leaving through this exit.</param>
+static ADDRINT PIN_FAST_ANALYSIS_CALL TracePrefixUnmarked(TraceCoverage *tc, UINT32 prefix)
+{
+	return (prefix > tc->_markedPrefix) | (tc->_iteration != persistentIteration) | (tc->_liveGeneration != liveGeneration);
+}
+
+/// <summary>
+/// Marks the executed prefix of a trace.
+/// </summary>
+/// <param name="tc">The trace coverage.</param>
+/// <param name="prefix">Number of blocks executed when leaving through this exit.</param>
+static VOID MarkTracePrefix(TraceCoverage *tc, UINT32 prefix)
+{
+	// A new persistent iteration, or a live reset, starts with nothing marked
+	if (tc->_iteration != persistentIteration || tc->_liveGeneration != liveGeneration)
+	{
+		tc->_iteration = persistentIteration;
+		tc->_liveGeneration = liveGeneration;
+		tc->_markedPrefix = 0;
+	}
+
+	for (UINT32 i = tc->_markedPrefix; i < prefix; i++)
+		LogBbl(tc->_bbls[i]);
+
+	if (prefix > tc->_markedPrefix)
+		tc->_markedPrefix = prefix;
+}
+
+/// <summary>
+/// Inserts one coverage call per trace exit, instead of one per basic block.
+/// </summary>
+/// <param name="trace">The trace.</param>
+static void InstrumentTraceCoverage(TRACE trace)
+{
+	UINT32 numBbls = TRACE_NumBbl(trace);
+
+	TraceCoverage *tc = new TraceCoverage;
+	tc->_numBbls = numBbls;
+	tc->_bbls = new BblTrace *[numBbls];
+
+	UINT32 i = 0;
+	for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl), i++)
+		tc->_bbls[i] = GetBblTrace(bbl);
+
+	// The head is about to run
+	LogBbl(tc->_bbls[0]);
+
+	// Exits within the already marked prefix need no call, except in persistent mode where every input starts unmarked
+	tc->_markedPrefix = 0;
+	tc->_iteration = persistentIteration;
+	tc->_liveGeneration = liveGeneration;
+	while (persistentAddr == 0 && tc->_markedPrefix < numBbls && tc->_bbls[tc->_markedPrefix]->_marked
+		&& tc->_bbls[tc->_markedPrefix]->_liveGeneration == liveGeneration)
+		tc->_markedPrefix++;
+
+	if (tc->_markedPrefix == numBbls)
+	{
+		delete[] tc->_bbls;
+		delete tc;
+		return;
+	}
+
+	tc->_next = traceCoverageList;
+	traceCoverageList = tc;
+
+	i = 0;
+	for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl), i++)
+	{
+		if (i + 1 <= tc->_markedPrefix)
+			continue;
+
+		INS tail = BBL_InsTail(bbl);
+
+		if (i + 1 == numBbls) // Leaving the trace through its last block, whichever way
+		{
+			INS_InsertIfCall(tail, IPOINT_BEFORE, AFUNPTR(TracePrefixUnmarked), IARG_FAST_ANALYSIS_CALL, IARG_PTR, tc, IARG_UINT32, numBbls, IARG_END);
+			INS_InsertThenCall(tail, IPOINT_BEFORE, AFUNPTR(MarkTracePrefix), IARG_PTR, tc, IARG_UINT32, numBbls, IARG_END);
+		}
+		else if (INS_IsBranchOrCall(tail) && INS_IsValidForIpointTakenBranch(tail)) // Taken branches leave the trace, fall through continues in it
+		{
+			INS_InsertIfCall(tail, IPOINT_TAKEN_BRANCH, AFUNPTR(TracePrefixUnmarked), IARG_FAST_ANALYSIS_CALL, IARG_PTR, tc, IARG_UINT32, i + 1, IARG_END);
+			INS_InsertThenCall(tail, IPOINT_TAKEN_BRANCH, AFUNPTR(MarkTracePrefix), IARG_PTR, tc, IARG_UINT32, i + 1, IARG_END);
+		}
+	}
+}
+
+/// <summary>
+/// Copies the next corpus input to the path the target reads, and starts a new coverage iteration.
+/// </summary>
+/// <param name="sp">The stack pointer at the function entry.</param>
+/// <returns>false if no input is left.</returns>
+static bool BeginPersistentIteration(ADDRINT sp)
+{
+	// Inputs that cannot be put in place are recorded as failed and skipped, running would record the previous input's coverage
+	while (persistentNext < persistentCorpus.size()
+		&& !WINDOWS::CopyFileA(persistentCorpus[persistentNext].c_str(), KnobPersistentInput.Value().c_str(), FALSE))
+	{
+		cerr << "Error: could not copy " << persistentCorpus[persistentNext] << " to " << KnobPersistentInput.Value() << endl;
+
+		*persistentOut << persistentCorpus[persistentNext] << "\tfailed" << endl << flush;
+		persistentNext++;
+	}
+
+	if (persistentNext >= persistentCorpus.size())
+		return false;
+
+	PIN_GetLock(&persistentLock, PIN_ThreadId() + 1);
+	persistentIteration++;
+	iterationBbls.clear();
+	PIN_ReleaseLock(&persistentLock);
+
+	persistentSp = sp;
+
+	// The entry block was marked when its trace was instrumented
+	std::unordered_map<ADDRINT, BblTrace *>::iterator it = bblTraceIndex.find(persistentAddr);
+	if (it != bblTraceIndex.end())
+		LogBbl(it->second);
+
+	return true;
+}
+
+/// <summary>
+/// Writes the coverage record of the input that just finished.
+/// </summary>
+/// <param name="complete">false if the process exits (or crashes) before the function returned; the record is tagged incomplete.</param>
+static void EndPersistentIteration(bool complete)
+{
+	std::ostringstream ss;
+	ss << setfill('0');
+
+	PIN_GetLock(&persistentLock, PIN_ThreadId() + 1);
+
+	ss << persistentCorpus[persistentNext] << "\t" << dec << iterationBbls.size() << "\t";
+	for (size_t i = 0; i < iterationBbls.size(); i++)
+		ss << (i == 0 ? "" : " ") << setw(8) << hex << (iterationBbls[i] - imgBaseAddr);
+	if (!complete)
+		ss << "\tincomplete";
+	ss << endl;
+
+	PIN_ReleaseLock(&persistentLock);
+
+	*persistentOut << ss.str() << flush;
+	persistentNext++;
+}
+
+/// <summary>
+/// Called at the persistent function's entry. Saves the context the first time, later iterations re-enter with it.
+/// </summary>
+static VOID PersistentEnter(THREADID tid, CONTEXT *ctxt, ADDRINT sp)
+{
+	// Already iterating (this is a PIN_ExecuteAt re-entry or recursion), or the corpus is done
+	if (persistentSp != 0 || persistentNext >= persistentCorpus.size())
+		return;
+
+	PIN_SaveContext(ctxt, &persistentContext);
+	persistentTid = tid;
+
+	// Without an input the function runs once, uninstrumented by persistent mode
+	BeginPersistentIteration(sp);
+}
+
+/// <summary>
+/// Checks whether a return leaves the persistent function. Inlined by Pin.
+/// </summary>
+static ADDRINT PIN_FAST_ANALYSIS_CALL PersistentIsReturn(THREADID tid, ADDRINT sp)
+{
+	return (sp == persistentSp) & (tid == persistentTid);
+}
+
+/// <summary>
+/// Called when the persistent function returns. Emits the input's coverage and re-enters the function with the next input.
+/// </summary>
+static VOID PersistentReturn(THREADID tid, ADDRINT sp)
+{
+	EndPersistentIteration(true);
+
+	if (!BeginPersistentIteration(sp))
+	{
+		// Corpus done, let the function return to its caller
+		persistentSp = 0;
+		return;
+	}
+
+	// Never returns, the code cache stays warm
+	PIN_ExecuteAt(&persistentContext);
+}
+
+/// <summary>
+/// Finds the persistent function in the instrumented module.
+/// </summary>
+/// <param name="img">The img.</param>
+static void ResolvePersistentFunction(IMG img)
+{
+	string function = KnobPersistentFunction.Value();
+
+	if (function.compare(0, 2, "0x") == 0)
+	{
+		persistentAddr = imgBaseAddr + (ADDRINT)strtoull(function.c_str(), 0, 16);
+	}
+	else
+	{
+		ModuleEntry *mod = GetModuleEntry(imgBaseAddr);
+		if (mod != 0)
+		{
+			PIN_GetLock(&symbolLock, PIN_ThreadId() + 1);
+			if (!mod->_exportsLoaded)
+				LoadExports(mod);
+
+			for (size_t i = 0; i < mod->_exports.size() && persistentAddr == 0; i++)
+			{
+				if (mod->_exports[i].second == function)
+					persistentAddr = mod->_start + mod->_exports[i].first;
+			}
+			PIN_ReleaseLock(&symbolLock);
+		}
+
+		// Debug symbols with -symbols full, exports known to Pin otherwise
+		RTN rtn = RTN_FindByName(img, function.c_str());
+		if (persistentAddr == 0 && RTN_Valid(rtn))
+			persistentAddr = RTN_Address(rtn);
+	}
+
+	std::ostringstream ss;
+	if (persistentAddr == 0)
+		ss << "# Persistent function " << function << " not found" << endl;
+	else
+		ss << "# Persistent function " << function << " at 0x" << hex << (persistentAddr - imgBaseAddr) << ", " << dec << persistentCorpus.size() << " inputs" << endl;
+	output(ss.str());
+}
+
+/// <summary>
+/// Instruments the persistent function's entry, and the returns that may leave it.
+/// </summary>
+/// <param name="bbl">The bbl.</param>
+static void InstrumentPersistent(BBL bbl)
+{
+	if (persistentAddr >= BBL_Address(bbl) && persistentAddr < BBL_Address(bbl) + BBL_Size(bbl))
+	{
+		for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+		{
+			if (INS_Address(ins) == persistentAddr)
+				INS_InsertCall(ins, IPOINT_BEFORE, AFUNPTR(PersistentEnter), IARG_THREAD_ID, IARG_CONTEXT, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+		}
+	}
+
+	INS tail = BBL_InsTail(bbl);
+	if (INS_IsRet(tail))
+	{
+		// At the return the stack pointer is back where it was at the entry (pointing at the return address)
+		INS_InsertIfCall(tail, IPOINT_BEFORE, AFUNPTR(PersistentIsReturn), IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+		INS_InsertThenCall(tail, IPOINT_BEFORE, AFUNPTR(PersistentReturn), IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+	}
+}
+
+/// <summary>
+/// Reads the corpus and opens the per input coverage file.
+/// </summary>
+static bool InitPersistent()
+{
+	// Without it every iteration would re-run the same input, recorded under each corpus file's name
+	if (KnobPersistentInput.Value().empty())
+	{
+		cerr << "Error: -persistent_function requires -persistent_input." << endl;
+		return false;
+	}
+
+	std::ifstream corpus(KnobPersistentCorpus.Value().c_str());
+	if (!corpus)
+	{
+		cerr << "Error: could not read the persistent corpus " << KnobPersistentCorpus.Value() << endl;
+		return false;
+	}
+
+	string line;
+	while (std::getline(corpus, line))
+	{
+		if (!line.empty() && line[line.length() - 1] == '\r')
+			line.erase(line.length() - 1);
+		if (!line.empty())
+			persistentCorpus.push_back(line);
+	}
+
+	PIN_InitLock(&persistentLock);
+
+	// One line per input: path, block count, block offsets, then "incomplete" if the process exited during it. "path\tfailed" if it could not be copied
+	persistentOut = new std::ofstream(OutputSidecarName(".inputs").c_str(), fstream::out | fstream::trunc);
+
+	return true;
+}
+
+/// <summary>
+/// Writes ordered trace records to the trace file.
+/// </summary>
+/// <param name="records">The records.</param>
+/// <param name="numRecords">The number of records.</param>
+static void WriteOrderedRecords(const OrderedRecord *records, UINT64 numRecords)
+{
+	std::ostringstream ss;
+	ss << setfill('0');
+
+	for (UINT64 i = 0; i < numRecords; i++)
+	{
+		ss << setw(4) << hex << records[i]._tid << " "
+			<< setw(8) << hex << records[i]._offset << " "
+			<< setw(16) << hex << records[i]._timestamp << endl;
+	}
+
+	*orderedTraceOut << ss.str();
+	orderedRecordCount += numRecords;
+}
+
+/// <summary>
+/// Copies the most recent records into the ring dumped on exceptions. Caller holds orderedTraceLock.
+/// </summary>
+/// <param name="records">The records.</param>
+/// <param name="numRecords">The number of records.</param>
+static void UpdateOrderedRing(const OrderedRecord *records, UINT64 numRecords)
+{
+	UINT32 ringSize = KnobOrderedTraceRing.Value();
+
+	if (ringSize == 0)
+		return;
+
+	UINT64 first = numRecords > ringSize ? numRecords - ringSize : 0;
+	for (UINT64 i = first; i < numRecords; i++)
+	{
+		orderedRing[orderedRingNext % ringSize] = records[i];
+		orderedRingNext++;
+	}
+}
+
+/// <summary>
+/// Called by Pin when a thread's ordered trace buffer is full, or the thread exits.
+/// Hands the full buffer to the writer thread and gives the thread a fresh one.
+/// </summary>
+static VOID *OrderedBufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf, UINT64 numElements, VOID *v)
+{
+	if (numElements == 0)
+		return buf;
+
+	OrderedRecord *records = (OrderedRecord *)buf;
+
+	PIN_GetLock(&orderedTraceLock, tid + 1);
+
+	UpdateOrderedRing(records, numElements);
+
+	if (orderedWriterDone) // Writer is gone (process exiting), write synchronously and reuse the buffer
+	{
+		WriteOrderedRecords(records, numElements);
+		memset(buf, 0, KnobOrderedTracePages.Value() * 0x1000);
+		PIN_ReleaseLock(&orderedTraceLock);
+		return buf;
+	}
+
+	OrderedChunk *chunk = new OrderedChunk;
+	chunk->_records = records;
+	chunk->_numRecords = numElements;
+	chunk->_next = 0;
+
+	if (orderedChunkTail)
+		orderedChunkTail->_next = chunk;
+	else
+		orderedChunkHead = chunk;
+	orderedChunkTail = chunk;
+
+	// Unfilled records are left zeroed so other threads' partial buffers can be recovered on exception
+	VOID *next = PIN_AllocateBuffer(id);
+	memset(next, 0, KnobOrderedTracePages.Value() * 0x1000);
+
+	if (tid < orderedBufferBase.size())
+		orderedBufferBase[tid] = (OrderedRecord *)next;
+
+	PIN_SemaphoreSet(&orderedTraceReady);
+	PIN_ReleaseLock(&orderedTraceLock);
+
+	return next;
+}
+
+/// <summary>
+/// Remembers where a new thread's first ordered trace buffer starts.
+/// </summary>
+static VOID OrderedTraceThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+	OrderedRecord *base = (OrderedRecord *)PIN_GetBufferPointer(ctxt, orderedTraceBuffer);
+
+	// Pin does not clear the first buffer
+	memset(base, 0, KnobOrderedTracePages.Value() * 0x1000);
+
+	PIN_GetLock(&orderedTraceLock, tid + 1);
+	if (tid >= orderedBufferBase.size())
+		orderedBufferBase.resize(tid + 1, 0);
+	orderedBufferBase[tid] = base;
+	PIN_ReleaseLock(&orderedTraceLock);
+}
+
+/// <summary>
+/// Forgets the buffer of an exiting thread. Its records were handed over by OrderedBufferFull.
+/// </summary>
+static VOID OrderedTraceThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+	PIN_GetLock(&orderedTraceLock, tid + 1);
+	if (tid < orderedBufferBase.size())
+		orderedBufferBase[tid] = 0;
+	PIN_ReleaseLock(&orderedTraceLock);
+}
+
+/// <summary>
+/// Internal thread that writes full ordered trace buffers to disk.
+/// </summary>
+static VOID OrderedTraceWriter(VOID *arg)
+{
+	for (;;)
+	{
+		PIN_SemaphoreWait(&orderedTraceReady);
+
+		PIN_GetLock(&orderedTraceLock, 0);
+		OrderedChunk *chunk = orderedChunkHead;
+		orderedChunkHead = orderedChunkTail = 0;
+		PIN_SemaphoreClear(&orderedTraceReady);
+		bool stop = orderedWriterStop;
+		bool flush = orderedFlushRequested;
+		orderedFlushRequested = false;
+		PIN_ReleaseLock(&orderedTraceLock);
+
+		while (chunk != 0)
+		{
+			WriteOrderedRecords(chunk->_records, chunk->_numRecords);
+			PIN_DeallocateBuffer(orderedTraceBuffer, chunk->_records);
+
+			OrderedChunk *next = chunk->_next;
+			delete chunk;
+			chunk = next;
+		}
+
+		if (flush)
+			orderedTraceOut->flush();
+
+		if (stop)
+			break;
+	}
+
+	orderedTraceOut->flush();
+}
+
+/// <summary>
+/// Stops the writer thread before Pin terminates internal threads.
+/// </summary>
+static VOID OrderedTracePrepareForFini(VOID *v)
+{
+	PIN_GetLock(&orderedTraceLock, 0);
+	orderedWriterStop = true;
+	PIN_SemaphoreSet(&orderedTraceReady);
+	PIN_ReleaseLock(&orderedTraceLock);
+
+	PIN_WaitForThreadTermination(orderedWriterUid, PIN_INFINITE_TIMEOUT, 0);
+
+	// Anything queued after the writer's last pass is written here, later buffers are written by OrderedBufferFull
+	PIN_GetLock(&orderedTraceLock, 0);
+	for (OrderedChunk *chunk = orderedChunkHead; chunk != 0;)
+	{
+		WriteOrderedRecords(chunk->_records, chunk->_numRecords);
+		PIN_DeallocateBuffer(orderedTraceBuffer, chunk->_records);
+
+		OrderedChunk *next = chunk->_next;
+		delete chunk;
+		chunk = next;
+	}
+	orderedChunkHead = orderedChunkTail = 0;
+	orderedWriterDone = true;
+	PIN_ReleaseLock(&orderedTraceLock);
+}
+
+/// <summary>
+/// Orders trace records by timestamp.
+/// </summary>
+static bool OrderedRecordLess(const OrderedRecord &a, const OrderedRecord &b)
+{
+	return a._timestamp < b._timestamp;
+}
+
+/// <summary>
+/// Outputs the last N ordered trace records of all threads as script comments.
+/// </summary>
+/// <param name="tid">The thread that raised the exception.</param>
+/// <param name="ctxt">The context of the thread at the exception.</param>
+/// <param name="reason">Why the ring is being dumped.</param>
+static void DumpOrderedRing(THREADID tid, const CONTEXT *ctxt, string reason)
+{
+	std::ostringstream ss;
+	ss << setfill('0');
+
+	UINT32 ringSize = KnobOrderedTraceRing.Value();
+	UINT64 maxPending = KnobOrderedTracePages.Value() * 0x1000 / sizeof(OrderedRecord);
+	std::vector<OrderedRecord> records;
+
+	PIN_GetLock(&orderedTraceLock, tid + 1);
+
+	// Records already handed over by OrderedBufferFull
+	UINT64 count = orderedRingNext < ringSize ? orderedRingNext : ringSize;
+	for (UINT64 i = orderedRingNext - count; i < orderedRingNext; i++)
+		records.push_back(orderedRing[i % ringSize]);
+
+	// Records still sitting in the threads' buffers are the most recent
+	for (THREADID t = 0; t < orderedBufferBase.size(); t++)
+	{
+		OrderedRecord *base = orderedBufferBase[t];
+		if (base == 0)
+			continue;
+
+		UINT64 pending = 0;
+		if (t == tid) // The faulting thread's fill position is exact
+		{
+			OrderedRecord *fill = (OrderedRecord *)PIN_GetBufferPointer(const_cast<CONTEXT *>(ctxt), orderedTraceBuffer);
+			if (fill >= base && fill <= base + maxPending)
+				pending = fill - base;
+		}
+		else // Other threads keep running, their buffers were zeroed before use
+		{
+			while (pending < maxPending && base[pending]._timestamp != 0)
+				pending++;
+		}
+
+		records.insert(records.end(), base, base + pending);
+	}
+
+	PIN_ReleaseLock(&orderedTraceLock);
+
+	std::stable_sort(records.begin(), records.end(), OrderedRecordLess);
+
+	UINT64 first = records.size() > ringSize ? records.size() - ringSize : 0;
+
+	ss << "# Ordered trace ring (" << reason << " in thread " << dec << tid << ")" << endl;
+	for (UINT64 i = first; i < records.size(); i++)
+	{
+		OrderedRecord *rec = &records[(size_t)i];
+		ss << "# ring " << setw(4) << hex << rec->_tid << " " << setw(8) << hex << rec->_offset << " " << setw(16) << hex << rec->_timestamp << endl;
+	}
+	ss << "# End ordered trace ring" << endl;
+
+	output(ss.str());
+
+	PIN_GetLock(&outputLock, tid + 1);
+	out->flush();
+	PIN_ReleaseLock(&outputLock);
+}
+
+/// <summary>
+/// Context change callback. Dumps the ordered trace ring when the application raises an exception or receives a signal.
 /// </summary>
-/// <param name="filename">The filename.</param>
-/// <returns>The filename without the path.</returns>
-static string StripPath(string filename)
+static VOID OrderedTraceContextChange(THREADID tid, CONTEXT_CHANGE_REASON reason, const CONTEXT *from, CONTEXT *to, INT32 info, VOID *v)
 {
-	size_t index = filename.find_last_of("/\\");
+	if (from == 0)
+		return;
 
-	if (index >= 0)
-		return filename.substr(index + 1, 0x100);
-	return filename;
+	std::ostringstream ss;
+
+	switch (reason)
+	{
+	case CONTEXT_CHANGE_REASON_EXCEPTION:
+		ss << "exception 0x" << hex << (UINT32)info;
+		break;
+	case CONTEXT_CHANGE_REASON_FATALSIGNAL:
+	case CONTEXT_CHANGE_REASON_SIGNAL:
+		ss << "signal " << dec << info;
+		break;
+	default:
+		return;
+	}
+
+	DumpOrderedRing(tid, from, ss.str());
 }
 
 /// <summary>
-/// Parses the filename without the extension.
+/// Sets up the ordered trace buffer, the trace file and the writer thread.
 /// </summary>
-/// <param name="filename">The filename.</param>
-/// <returns>Filename without extension.</returns>
-static string FilenameWithoutExtension(string filename)
+static bool InitOrderedTrace()
 {
-	size_t index = filename.find_last_of('.');
+	orderedTraceBuffer = PIN_DefineTraceBuffer(sizeof(OrderedRecord), KnobOrderedTracePages.Value(), OrderedBufferFull, 0);
+	if (orderedTraceBuffer == BUFFER_ID_INVALID)
+	{
+		cerr << "Error: could not allocate the ordered trace buffer." << endl;
+		return false;
+	}
 
-	if (index >= 0)
-		return filename.substr(0, index);
-	return filename;
+	orderedTraceOut = new std::ofstream(orderedTraceFile.c_str(), fstream::out | fstream::trunc);
+	*orderedTraceOut << "# Ablation ordered trace: " << module << endl;
+	*orderedTraceOut << "# tid offset timestamp" << endl;
+
+	if (KnobOrderedTraceRing.Value() > 0)
+		orderedRing = new OrderedRecord[KnobOrderedTraceRing.Value()];
+
+	PIN_InitLock(&orderedTraceLock);
+	PIN_SemaphoreInit(&orderedTraceReady);
+
+	if (PIN_SpawnInternalThread(OrderedTraceWriter, 0, 0, &orderedWriterUid) == INVALID_THREADID)
+	{
+		cerr << "Error: could not start the ordered trace writer thread." << endl;
+		return false;
+	}
+
+	PIN_AddThreadStartFunction(OrderedTraceThreadStart, 0);
+	PIN_AddThreadFiniFunction(OrderedTraceThreadFini, 0);
+	PIN_AddPrepareForFiniFunction(OrderedTracePrepareForFini, 0);
+	PIN_AddContextChangeFunction(OrderedTraceContextChange, 0);
+
+	return true;
 }
 
 /// <summary>
-/// Gets the entry of the module that contains address.
+/// Credits the instructions executed since the last credit to function's self cost.
 /// </summary>
-/// <param name="address">The address.</param>
-static ModuleEntry *GetModuleEntry(ADDRINT address)
+/// <param name="t">The thread's call graph state.</param>
+/// <param name="function">The function that was executing.</param>
+static void CreditSelfCost(CallGraphThread *t, ADDRINT function)
 {
-	for (ModuleEntry *mod = moduleList; mod != 0; mod = mod->_next)
+	if (t->_insCount != t->_selfMark)
 	{
-		if (mod->_start <= address && mod->_end > address)
-			return mod;
+		t->_self[function] += t->_insCount - t->_selfMark;
+		t->_selfMark = t->_insCount;
 	}
-
-	return 0;
 }
 
 /// <summary>
-/// Invalidates the code cache outside of the desired module.
+/// Pops the shadow frames that have returned, i.e. those whose call was made at or below sp, and accumulates their inclusive counts.
 /// </summary>
-static void InvalidateTraceExternal()
+/// <param name="t">The thread's call graph state.</param>
+/// <param name="sp">The stack pointer the caller's frame would have.</param>
+static void UnwindShadowStack(CallGraphThread *t, ADDRINT sp)
 {
-	UINT32 invalidated = CODECACHE_InvalidateRange(0, imgBaseAddr);
-	invalidated += CODECACHE_InvalidateRange(imgEndAddr, RSIZE_MAX);
-
-	if (invalidated > 0 && KnobVerbose.Value())
+	while (!t->_stack.empty() && t->_stack.back()._sp <= sp)
 	{
-		std::ostringstream ss;
-		ss << setfill('0');
-		ss << "# Invalidated " << hex << invalidated << " traces" << endl << flush;
-		output(ss.str());
+		ShadowFrame &frame = t->_stack.back();
+
+		// Only the innermost frame was executing, frames unwound along with it get nothing
+		CreditSelfCost(t, frame._function);
+
+		CallEdge &edge = t->_edges[CallEdgeKey(frame._callSite, frame._function)];
+		edge._inclusive += t->_insCount - frame._insCount;
+
+		t->_stack.pop_back();
 	}
 }
 
 /// <summary>
-/// Filters the trace by constraining to addresses within the module specified on the command-line.
+/// Counts the instructions executed by a basic block. Inlined by Pin.
 /// </summary>
-/// <param name="trace">The trace.</param>
-/// <returns></returns>
-static bool FilterTrace(TRACE trace)
+static VOID PIN_FAST_ANALYSIS_CALL CountBblInstructions(CallGraphThread *t, UINT32 numIns)
 {
-	if (!imgBaseAddr || !imgEndAddr)
-		return false;
-
-	if (TRACE_Address(trace) < imgBaseAddr || TRACE_Address(trace) > imgEndAddr)
-		return false;
-
-	return true;
+	t->_insCount += numIns;
 }
 
 /// <summary>
-/// Outputs virtual calls as script.
+/// Pushes a shadow frame and counts the call edge.
 /// </summary>
-/// <param name="caller">The caller.</param>
-/// <param name="target">The target.</param>
-static void OutputVirtualCall(ADDRINT caller, ADDRINT target)
+/// <param name="tid">The thread.</param>
+/// <param name="callSite">The call instruction.</param>
+/// <param name="callerFunction">The function containing the call, 0 if unknown.</param>
+/// <param name="target">The callee.</param>
+/// <param name="sp">The stack pointer before the call.</param>
+static VOID ShadowCall(THREADID tid, ADDRINT callSite, ADDRINT callerFunction, ADDRINT target, ADDRINT sp)
 {
-	std::ostringstream ss;
-	ss << setfill('0');
+	CallGraphThread *t = (CallGraphThread *)PIN_GetThreadData(callGraphKey, tid);
 
-	if (target >= imgBaseAddr && target < imgEndAddr) // Target is within current module
-	{
-		ss << "createXRef(0x" << setw(8) << hex << (caller - imgBaseAddr) << ", 0x" << setw(8) << hex << (target - imgBaseAddr) << ")";
-		
-	}
-	else // Target is outside of the current module
-	{
-	
-		ModuleEntry *entry = GetModuleEntry(target);
-		ss << "createXRefExternal(0x" << setw(8) << hex << (caller - imgBaseAddr) << ", \"" 
-			<< (entry == 0 ? string("__unk__") : entry->_name) 
-			<< "!" 
-			<< RTN_FindNameByAddress(target) << " "
-			<< hex << target << "\")";
+	// Frames at or below the current stack pointer have returned (possibly through uninstrumented code)
+	UnwindShadowStack(t, sp);
 
-		if (KnobVerbose.Value())
-			ss << "\t# " << setw(8) << hex << target - entry->_start;
-	}
+	if (callerFunction == 0)
+		callerFunction = t->_stack.empty() ? callSite : t->_stack.back()._function;
 
-	ss << endl;
-	output(ss.str());
+	if (t->_stack.empty())
+		t->_rootFunction = callerFunction;
+	CreditSelfCost(t, callerFunction);
+
+	CallEdge &edge = t->_edges[CallEdgeKey(callSite, target)];
+	edge._callerFunction = callerFunction;
+	edge._calls++;
+
+	ShadowFrame frame;
+	frame._callSite = callSite;
+	frame._function = target;
+	frame._sp = sp;
+	frame._insCount = t->_insCount;
+	t->_stack.push_back(frame);
 }
 
 /// <summary>
-/// Prints all resolved virtual calls for a caller.
+/// Pops the shadow frame a return instruction leaves.
 /// </summary>
-/// <param name="vcall">The vcall.</param>
-static void OutputResolvedVirtualCall(VirtualCall *vcall)
+/// <param name="tid">The thread.</param>
+/// <param name="sp">The stack pointer at the return (pointing at the return address).</param>
+static VOID ShadowReturn(THREADID tid, ADDRINT sp)
 {
-	for (int i = 0; i < vcall->_numTargets; i++)
-	{
-		OutputVirtualCall(vcall->_caller, vcall->_targets[i]);
-	}
+	CallGraphThread *t = (CallGraphThread *)PIN_GetThreadData(callGraphKey, tid);
+	UnwindShadowStack(t, sp + sizeof(ADDRINT));
 }
 
 /// <summary>
-/// Resolves the virtual call.
+/// Allocates the call graph state of a new thread.
 /// </summary>
-/// <param name="target">The target.</param>
-/// <param name="vcallList">The vcall list.</param>
-static void ResolveVirtualCall(ADDRINT target, VirtualCall *vcallList)
+static VOID CallGraphThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
 {
-	if (vcallList->_numTargets > 0x40) // Only allow a max of 64 Virtual Calls to be resolved (avoids building a massive list when JIT code is constantly being cycled)
+	CallGraphThread *t = new CallGraphThread;
+	t->_insCount = 0;
+	t->_selfMark = 0;
+	t->_rootFunction = 0;
+	PIN_SetThreadData(callGraphKey, t, tid);
+	PIN_SetContextReg(ctxt, callGraphReg, (ADDRINT)t);
+}
+
+/// <summary>
+/// Merges the call graph of an exiting thread into the global call graph.
+/// </summary>
+static VOID CallGraphThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+	CallGraphThread *t = (CallGraphThread *)PIN_GetThreadData(callGraphKey, tid);
+	if (t == 0)
 		return;
 
-	// Check that we haven't already resolved this target for this caller
-	for (int i = 0; i < vcallList->_numTargets; i++)
+	// Frames still open when the thread exits count up to here
+	UnwindShadowStack(t, RSIZE_MAX);
+	CreditSelfCost(t, t->_rootFunction);
+
+	PIN_GetLock(&callGraphLock, tid + 1);
+	for (CallEdgeMap::iterator it = t->_edges.begin(); it != t->_edges.end(); ++it)
 	{
-		if (vcallList->_targets[i] == target)
-			return;
+		CallEdge &edge = callGraph[it->first];
+		edge._callerFunction = it->second._callerFunction;
+		edge._calls += it->second._calls;
+		edge._inclusive += it->second._inclusive;
 	}
+	for (FunctionCostMap::iterator it = t->_self.begin(); it != t->_self.end(); ++it)
+		callGraphSelf[it->first] += it->second;
+	callGraphInstructions += t->_insCount;
+	PIN_ReleaseLock(&callGraphLock);
 
-	vcallList->_numTargets++;
-	vcallList->_targets = (ADDRINT *)realloc(vcallList->_targets, vcallList->_numTargets * sizeof(void *));
-	vcallList->_targets[vcallList->_numTargets - 1] = target;
-	resolvedCount++; // Increment global counter
-
-	if (!KnobDeferOutput.Value())
-		OutputVirtualCall(vcallList->_caller, target);
+	delete t;
+	PIN_SetThreadData(callGraphKey, 0, tid);
 }
 
 /// <summary>
-/// Outputs the marked BBL as scrupt.
+/// Gets a printable function name for the call graph.
 /// </summary>
-/// <param name="bb">The bb.</param>
-static void OutputMarkedBbl(BblTrace *bb)
+/// <param name="address">The function address.</param>
+static string CallGraphFunctionName(ADDRINT address)
 {
-	if (!bb->_marked)
-		return;
+	if (address == 0) // Thread that never made an instrumented call
+		return "(root)";
+
+	string name = SymbolNameByAddress(address);
+	if (!name.empty())
+		return name;
+
+	std::ostringstream ss;
+	ModuleEntry *mod = GetModuleEntry(address);
+	ss << "sub_" << hex << (mod == 0 ? address : address - mod->_start);
+	return ss.str();
+}
 
+/// <summary>
+/// Outputs the call graph as xref script and writes the callgrind file.
+/// </summary>
+static void OutputCallGraph()
+{
 	std::ostringstream ss;
 	ss << setfill('0');
 
-	ss << "mark(0x" << setw(8) << hex << (bb->_address - imgBaseAddr) << ")";
-	if (KnobVerbose.Value())
+	// Group edges by caller function. Every function seen as caller, callee or with a self cost gets an entry
+	std::map<ADDRINT, std::vector<CallEdgeMap::const_iterator> > byCaller;
+	for (CallEdgeMap::const_iterator it = callGraph.begin(); it != callGraph.end(); ++it)
 	{
-		ModuleEntry *mod = GetModuleEntry(bb->_address);
-		ss << "\t# " << (mod == 0 ? string("__unk__") : mod->_name) << "!" << RTN_FindNameByAddress(bb->_address);
+		byCaller[it->second._callerFunction].push_back(it);
+		byCaller[it->first.second];
 	}
-	ss << endl;
+	for (FunctionCostMap::const_iterator it = callGraphSelf.begin(); it != callGraphSelf.end(); ++it)
+		byCaller[it->first];
 
-	bbcount++;
+	output("# callGraph\n");
+	for (CallEdgeMap::const_iterator it = callGraph.begin(); it != callGraph.end(); ++it)
+	{
+		ADDRINT callSite = it->first.first;
+		ADDRINT target = it->first.second;
 
+		if (target >= imgBaseAddr && target < imgEndAddr)
+		{
+			ss << "createCallEdge(0x" << setw(8) << hex << (callSite - imgBaseAddr) << ", 0x" << setw(8) << hex << (target - imgBaseAddr);
+		}
+		else
+		{
+			ModuleEntry *entry = GetModuleEntry(target);
+			ss << "createCallEdgeExternal(0x" << setw(8) << hex << (callSite - imgBaseAddr) << ", \""
+				<< (entry == 0 ? string("__unk__") : entry->_name)
+				<< "!"
+				<< SymbolNameByAddress(target) << " "
+				<< hex << target << "\"";
+		}
+		ss << ", " << dec << it->second._calls << ", " << dec << it->second._inclusive << ")" << endl;
+	}
 	output(ss.str());
+
+	// callgrind, positions are instruction addresses and the only event is instructions executed in the module
+	std::ofstream cg(OutputSidecarName(".callgrind.out").c_str());
+	cg << "# callgrind format" << endl;
+	cg << "version: 1" << endl;
+	cg << "creator: Ablation" << endl;
+	cg << "pid: " << dec << _getpid() << endl;
+	cg << "cmd: " << module << endl;
+	cg << "positions: instr" << endl;
+	cg << "events: Ir" << endl;
+	cg << "summary: " << dec << callGraphInstructions << endl;
+
+	for (std::map<ADDRINT, std::vector<CallEdgeMap::const_iterator> >::const_iterator fn = byCaller.begin(); fn != byCaller.end(); ++fn)
+	{
+		FunctionCostMap::const_iterator self = callGraphSelf.find(fn->first);
+
+		ModuleEntry *mod = GetModuleEntry(fn->first);
+		cg << endl;
+		cg << "ob=" << (mod == 0 ? string("__unk__") : mod->_name) << endl;
+		cg << "fn=" << CallGraphFunctionName(fn->first) << endl;
+		cg << "0x" << hex << fn->first << " " << dec << (self == callGraphSelf.end() ? 0 : self->second) << endl;
+
+		for (size_t i = 0; i < fn->second.size(); i++)
+		{
+			ADDRINT callSite = fn->second[i]->first.first;
+			ADDRINT target = fn->second[i]->first.second;
+			const CallEdge &edge = fn->second[i]->second;
+
+			ModuleEntry *cmod = GetModuleEntry(target);
+			cg << "cob=" << (cmod == 0 ? string("__unk__") : cmod->_name) << endl;
+			cg << "cfn=" << CallGraphFunctionName(target) << endl;
+			cg << "calls=" << dec << edge._calls << " 0x" << hex << target << endl;
+			cg << "0x" << hex << callSite << " " << dec << edge._inclusive << endl;
+		}
+	}
 }
 
 /// <summary>
-/// Logs the BBL execution.
+/// Sets up the per-thread call graph state.
 /// </summary>
-/// <param name="bb">The bb.</param>
-static void LogBbl(BblTrace *bb)
+static bool InitCallGraph()
 {
-	if (bb->_marked)
-		return;
+	callGraphKey = PIN_CreateThreadDataKey(0);
+	if (callGraphKey == INVALID_TLS_KEY)
+	{
+		cerr << "Error: could not allocate the call graph thread data key." << endl;
+		return false;
+	}
 
-	bb->_marked = true;
-	if (!KnobDeferOutput.Value())
-		OutputMarkedBbl(bb);
+	callGraphReg = PIN_ClaimToolRegister();
+	if (!REG_valid(callGraphReg))
+	{
+		cerr << "Error: could not claim a tool register for the call graph." << endl;
+		return false;
+	}
+
+	PIN_InitLock(&callGraphLock);
+	PIN_AddThreadStartFunction(CallGraphThreadStart, 0);
+	PIN_AddThreadFiniFunction(CallGraphThreadFini, 0);
+
+	return true;
 }
 
 /// <summary>
@@ -329,27 +2184,68 @@ static void PrintTrace(TRACE trace, VOID *v)
 	if (!FilterTrace(trace))
 		return;
 
+	if (!KnobNoTrace.Value() && traceGranularity)
+		InstrumentTraceCoverage(trace);
+
 	// Visit every basic block  in the trace
 	for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
 	{
+		// Append (thread, block, timestamp) to the thread's trace buffer without an analysis call
+		if (orderedTraceBuffer != BUFFER_ID_INVALID)
+		{
+			INS_InsertFillBuffer(BBL_InsHead(bbl), IPOINT_BEFORE, orderedTraceBuffer,
+				IARG_TSC, offsetof(OrderedRecord, _timestamp),
+				IARG_THREAD_ID, offsetof(OrderedRecord, _tid),
+				IARG_UINT32, (UINT32)(BBL_Address(bbl) - imgBaseAddr), offsetof(OrderedRecord, _offset),
+				IARG_END);
+		}
+
 		if (!KnobNoTrace.Value())
 		{
-			BblTrace * bb = new BblTrace;
-			bb->_address = BBL_Address(bbl);
-			bb->_marked = false;
-			bb->_next = bblTraceList;
-			bblTraceList = bb;
+			BblTrace * bb = GetBblTrace(bbl);
 
 			if (bbl == TRACE_BblHead(trace))
 			{
-				bb->_marked = true;
-				if (!KnobDeferOutput.Value())
-					OutputMarkedBbl(bb);
+				LogBbl(bb);
+
+				// Every persistent iteration needs to see the head run
+				if (!traceGranularity && persistentAddr != 0)
+					BBL_InsertCall(bbl, IPOINT_BEFORE, AFUNPTR(LogBbl), IARG_PTR, bb, IARG_END);
 			}
-			else
+			else if (!traceGranularity && (!bb->_marked || persistentAddr != 0 || bb->_liveGeneration != liveGeneration)) // Reinstrumented blocks that already ran need no call
 			{
 				BBL_InsertCall(bbl, IPOINT_BEFORE, AFUNPTR(LogBbl), IARG_PTR, bb, IARG_END);
 			}
+
+			// Count executions until the block is hot, hot blocks are reinstrumented without the counter
+			if (KnobHeatThreshold.Value() > 0 && !bb->_hot)
+			{
+				BBL_InsertIfCall(bbl, IPOINT_BEFORE, AFUNPTR(CountBbl), IARG_FAST_ANALYSIS_CALL, IARG_PTR, bb, IARG_UINT32, KnobHeatThreshold.Value(), IARG_END);
+				BBL_InsertThenCall(bbl, IPOINT_BEFORE, AFUNPTR(HotBbl), IARG_PTR, bb, IARG_END);
+			}
+		}
+
+		if (persistentAddr != 0)
+			InstrumentPersistent(bbl);
+
+		// Maintain the shadow stack on calls and returns, and count instructions for inclusive costs
+		if (KnobCallGraph.Value())
+		{
+			BBL_InsertCall(bbl, IPOINT_BEFORE, AFUNPTR(CountBblInstructions), IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, callGraphReg, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+
+			INS tail = BBL_InsTail(bbl);
+			if (INS_IsCall(tail))
+			{
+				// Without symbols (-symbols none) Pin knows no routines, ShadowCall then attributes the call to the innermost shadow frame
+				RTN rtn = RTN_FindByAddress(INS_Address(tail));
+				ADDRINT callerFunction = RTN_Valid(rtn) ? RTN_Address(rtn) : 0;
+
+				INS_InsertCall(tail, IPOINT_BEFORE, AFUNPTR(ShadowCall), IARG_THREAD_ID, IARG_INST_PTR, IARG_ADDRINT, callerFunction, IARG_BRANCH_TARGET_ADDR, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+			}
+			else if (INS_IsRet(tail))
+			{
+				INS_InsertCall(tail, IPOINT_BEFORE, AFUNPTR(ShadowReturn), IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+			}
 		}
 
 		// Resolve virtual calls within the module
@@ -404,8 +2300,12 @@ static VOID ImageLoad(IMG img, VOID *v)
 		entry->_start = IMG_LowAddress(img);
 		entry->_end = IMG_HighAddress(img);
 		entry->_name = imgName;
+		entry->_path = name;
+		entry->_exportsLoaded = false;
 
 		moduleList = entry;
+
+		OutputModuleEntry(entry);
 	}
 
 	if (!module.empty() && imgName.compare(module) == 0)
@@ -413,6 +2313,17 @@ static VOID ImageLoad(IMG img, VOID *v)
 		imgBaseAddr = IMG_LowAddress(img);
 		imgEndAddr = IMG_HighAddress(img);
 
+		output("# TARGET: " + imgName + "\n");
+
+		if (!KnobPersistentFunction.Value().empty() && persistentAddr == 0)
+			ResolvePersistentFunction(img);
+
+		if (KnobSharedCoverage.Value() && sharedCoverage == 0)
+			AttachSharedCoverage();
+
+		if (KnobLive.Value() && live == 0)
+			InitLive();
+
 		// Trace Instrument
 		TRACE_AddInstrumentFunction(PrintTrace, 0);
 	}
@@ -433,6 +2344,8 @@ static void DeferredOutput()
 		virtualCallList = virtualCallList->_next;
 	}
 
+	BblTrace *hotList = bblTraceList;
+
 	// Output the BblTrace List
 	output("# bblTraceList");
 	while (bblTraceList != NULL)
@@ -440,6 +2353,14 @@ static void DeferredOutput()
 		OutputMarkedBbl(bblTraceList);
 		bblTraceList = bblTraceList->_next;
 	}
+
+	// Output the hot BblTrace List, after the marks so the heat color wins
+	if (KnobHeatThreshold.Value() > 0)
+	{
+		output("# hotBblTraceList\n");
+		for (BblTrace *bb = hotList; bb != 0; bb = bb->_next)
+			OutputHotBbl(bb);
+	}
 }
 
 /// <summary>
@@ -449,6 +2370,18 @@ static VOID Fini(INT32 code, VOID *v)
 {
 	if (KnobDeferOutput.Value()) // if not live, display info on process exit
 		DeferredOutput();
+
+	if (KnobCallGraph.Value()) // counts are only final at exit
+		OutputCallGraph();
+
+	DetachSharedCoverage();
+
+	// The input that was running when the process exited, often the one that crashed it
+	if (persistentSp != 0)
+	{
+		EndPersistentIteration(false);
+		persistentSp = 0;
+	}
 	
 	if (KnobVerbose.Value())
 	{
@@ -460,11 +2393,22 @@ static VOID Fini(INT32 code, VOID *v)
 			ss << "# " << setw(8) << hex << bbcount << "  -  Unique Basic Blocks" << endl;
 		if (!KnobNoResolveVirtualCalls.Value())
 			ss << "# " << setw(8) << hex << resolvedCount << "  -  Virtual Calls Resolved" << endl;
+		if (KnobHeatThreshold.Value() > 0)
+			ss << "# " << setw(8) << hex << hotCount << "  -  Hot Basic Blocks" << endl;
+		if (KnobOrderedTrace.Value())
+			ss << "# " << setw(8) << hex << orderedRecordCount << "  -  Ordered Trace Records" << endl;
+		if (KnobCallGraph.Value())
+			ss << "# " << setw(8) << hex << callGraph.size() << "  -  Call Edges" << endl;
+		if (!KnobPersistentFunction.Value().empty())
+			ss << "# " << setw(8) << hex << persistentNext << "  -  Persistent Inputs" << endl;
 		ss << "#======================================" << endl << flush;
 		
 		output(ss.str());
 	}
 
+	if (orderedTraceOut)
+		orderedTraceOut->flush();
+
 	out->flush();
 }
 
@@ -485,9 +2429,10 @@ static INT32 Usage()
 
 
 /// <summary>
-/// Writes the script header used to import the information into IDA.
+/// Builds the script header used to import the information into IDA.
 /// </summary>
-static void WriteScriptHeader()
+/// <returns>The script header.</returns>
+static string ScriptHeader()
 {
 	std::ostringstream ss;
 	ss << setfill('0');
@@ -543,13 +2488,17 @@ static void WriteScriptHeader()
 	ss << "" << endl;
 	ss << "	print \"%X 	Marked\" % (basicBlockEA)" << endl;
 	ss << "" << endl;
-	ss << "def mark(basicBlockEA):" << endl;
+	ss << "def mark(basicBlockEA, size=0):" << endl;
 	ss << "	basicBlockEA = moduleBase + basicBlockEA" << endl;
 	ss << "	if(GetFunctionAttr(basicBlockEA, FUNCATTR_START) ==  basicBlockEA):" << endl;
 	ss << "		ColorFunction(GetFunctionAttr(basicBlockEA, FUNCATTR_START), color)" << endl;
 	ss << "		ColorFunctionInstructions(GetFunctionAttr(basicBlockEA, FUNCATTR_START), 0xFFFFFF)	" << endl;
 	ss << "	ColorBasicBlock(basicBlockEA, color)" << endl;
 	ss << "" << endl;
+	ss << "def hot(basicBlockEA, size=0):" << endl;
+	ss << "	basicBlockEA = moduleBase + basicBlockEA" << endl;
+	ss << "	ColorBasicBlock(basicBlockEA, heatColor)" << endl;
+	ss << "" << endl;
 	ss << "def GetDemangledName(ea):" << endl;
 	ss << "	name = Name(ea)" << endl;
 	ss << "	" << endl;
@@ -585,16 +2534,32 @@ static void WriteScriptHeader()
 	ss << "	InsertXRefComment(caller, comment)" << endl;
 	ss << "	print \"External XRef Created: %s  =>  %s\\n\" % (commentFrom, comment)" << endl;
 	ss << "" << endl;
+	ss << "def createCallEdge(caller, target, calls, inclusive):" << endl;
+	ss << "	createXRef(caller, target)" << endl;
+	ss << "	InsertXRefComment(caller + moduleBase, \"calls: %d   inclusive instructions: %d\" % (calls, inclusive))" << endl;
+	ss << "" << endl;
+	ss << "def createCallEdgeExternal(caller, comment, calls, inclusive):" << endl;
+	ss << "	createXRefExternal(caller, \"%s   calls: %d   inclusive instructions: %d\" % (comment, calls, inclusive))" << endl;
+	ss << "" << endl;
 	ss << "" << endl;
 	ss << "print \"Using Module Base: %X\" % (moduleBase)" << endl;
 	ss << "" << endl;
 	ss << "color = " << KnobTraceColor.Value() << endl;
+	ss << "heatColor = " << KnobHeatColor.Value() << endl;
 	ss << "" << endl;
 	ss << "#############</ScriptHeader>#############" << endl;
 
 	ss << endl;
 
-	output(ss.str());
+	return ss.str();
+}
+
+/// <summary>
+/// Writes the script header used to import the information into IDA.
+/// </summary>
+static void WriteScriptHeader()
+{
+	output(ScriptHeader());
 	out->flush();
 }
 
@@ -625,6 +2590,31 @@ static bool Initialize(int argc, char *argv[])
 	if (module.empty())
 		return false;
 
+	if (KnobGranularity.Value().compare("trace") == 0)
+		traceGranularity = true;
+	else if (KnobGranularity.Value().compare("bbl") == 0)
+		traceGranularity = false;
+	else
+	{
+		cerr << "Error: -granularity must be \"trace\" or \"bbl\"." << endl;
+		return false;
+	}
+
+	if (KnobNoSymbols.Value() || KnobSymbols.Value().compare("none") == 0)
+		symbolMode = SYMBOLS_NONE;
+	else if (KnobSymbols.Value().compare("lazy") == 0)
+		symbolMode = SYMBOLS_LAZY;
+	else if (KnobSymbols.Value().compare("full") == 0)
+		symbolMode = SYMBOLS_FULL;
+	else
+	{
+		cerr << "Error: -symbols must be \"lazy\", \"full\" or \"none\"." << endl;
+		return false;
+	}
+
+	PIN_InitLock(&symbolLock);
+	PIN_InitLock(&outputLock);
+
 	fileout = KnobOutputFile.Value();
 
 	if (fileout.empty() || fileout.compare(".") == 0)
@@ -652,12 +2642,50 @@ static bool Initialize(int argc, char *argv[])
 		//}
 	}
 
+	// The merged coverage goes next to the root's output
+	sharedCoverageFile = (fileout.compare("console") == 0 || fileout.compare("cout") == 0 ? module + ".ablation" : FilenameWithoutExtension(fileout)) + ".merged.py";
+
+	// Every followed process writes its own output, tagged with its PID
+	if (KnobFollowChildren.Value() && fileout.compare("console") != 0 && fileout.compare("cout") != 0)
+	{
+		size_t ext = fileout.find_last_of('.');
+
+		ss.str("");
+		ss << dec << fileout.substr(0, ext) << "." << _getpid() << (ext == string::npos ? string("") : fileout.substr(ext));
+		fileout = ss.str();
+	}
+
 	out = &cout;
 	if (!fileout.empty() && fileout.compare("console") != 0 && fileout.compare("cout") != 0)
 	{
 		out = new std::ofstream(fileout.c_str(),  (KnobAppend.Value() ? fstream::out : fstream::out | fstream::app));
 	}
 
+	if (KnobCallGraph.Value() && !InitCallGraph())
+		return false;
+
+	if (KnobFollowChildren.Value())
+	{
+		pinArgc = argc;
+		pinArgv = argv;
+		PIN_AddFollowChildProcessFunction(FollowChild, 0);
+	}
+
+	if (!KnobPersistentFunction.Value().empty() && !InitPersistent())
+		return false;
+
+	// The server thread starts once the module is loaded, but must be stopped before Pin exits
+	if (KnobLive.Value())
+		PIN_AddPrepareForFiniFunction(LivePrepareForFini, 0);
+
+	if (KnobOrderedTrace.Value())
+	{
+		orderedTraceFile = OutputSidecarName(".trace");
+
+		if (!InitOrderedTrace())
+			return false;
+	}
+
 	//ss << setfill('0');
 	ss.str("");
 
@@ -667,12 +2695,19 @@ static bool Initialize(int argc, char *argv[])
 	if (KnobVerbose.Value())
 	{
 		ss << "# PID: " << _getpid() << endl;
-		ss << "# Granularity: " << "Basic Blocks" << endl;
+		ss << "# Granularity: " << (traceGranularity ? "Traces" : "Basic Blocks") << endl;
 		ss << "# Target Module: " << (module.empty() ? "*" : module) << endl;
 		ss << "# Trace: " << boolalpha << !KnobNoTrace.Value() << endl;
 		ss << "# Resolve Virtual Calls: " << boolalpha << !KnobNoResolveVirtualCalls.Value() << endl;
+		ss << "# Follow Children: " << boolalpha << KnobFollowChildren.Value() << endl;
+		ss << "# Shared Coverage: " << boolalpha << KnobSharedCoverage.Value() << endl;
+		ss << "# Heat Threshold: " << dec << KnobHeatThreshold.Value() << endl;
+		ss << "# Persistent Function: " << (KnobPersistentFunction.Value().empty() ? "none" : KnobPersistentFunction.Value()) << endl;
+		ss << "# Live: " << boolalpha << KnobLive.Value() << endl;
+		ss << "# Call Graph: " << boolalpha << KnobCallGraph.Value() << endl;
+		ss << "# Ordered Trace: " << (KnobOrderedTrace.Value() ? orderedTraceFile : "false") << endl;
 		ss << "# Verbose: " << boolalpha << KnobVerbose.Value() << endl;
-		ss << "# Symbols Loaded: " << boolalpha << !KnobNoSymbols.Value() << endl;
+		ss << "# Symbols: " << (symbolMode == SYMBOLS_FULL ? "full" : (symbolMode == SYMBOLS_LAZY ? "lazy" : "none")) << endl;
 
 		output(ss.str());
 	}
@@ -731,6 +2766,15 @@ VOID ImageUnload(IMG img, VOID *v)
 					delete bblTraceList;
 					bblTraceList = next;
 				}
+				bblTraceIndex.clear();
+
+				while (traceCoverageList != NULL)
+				{
+					TraceCoverage *next = traceCoverageList->_next;
+					delete[] traceCoverageList->_bbls;
+					delete traceCoverageList;
+					traceCoverageList = next;
+				}
 			}
 
 			if (prev != NULL)
@@ -752,12 +2796,6 @@ VOID ImageUnload(IMG img, VOID *v)
 /// </summary>
 int main(int argc, char * argv[])
 {
-	// Load symbols
-	if (!KnobNoSymbols.Value())
-	{
-		PIN_InitSymbolsAlt(DEBUG_OR_EXPORT_SYMBOLS);
-	}
-
 	// Initilize pintool
 	if (PIN_Init(argc, argv))
 		return Usage();
@@ -766,6 +2804,17 @@ int main(int argc, char * argv[])
 	if (!Initialize(argc, argv))
 		return -1;
 
+	// Load symbols. Pin can only load symbols for every module in the process, and PDBs are what makes startup slow.
+	// Lazy mode keeps Pin's routines from export symbols and names addresses from export tables read on demand (see SymbolNameByAddress).
+	if (symbolMode == SYMBOLS_FULL)
+	{
+		PIN_InitSymbolsAlt(DEBUG_OR_EXPORT_SYMBOLS);
+	}
+	else if (symbolMode == SYMBOLS_LAZY)
+	{
+		PIN_InitSymbolsAlt(EXPORT_SYMBOLS);
+	}
+
 	// Watch for specified module
 	IMG_AddInstrumentFunction(ImageLoad, 0);
 
@@ -0,0 +1,658 @@
+/*
+* AblationConvert
+* Converts Ablation output scripts to drcov (Lighthouse) and JSON.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <future>
+#include <thread>
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+using namespace std;
+
+/// <summary>
+/// Module parsed from a "# MODULE:" line.
+/// </summary>
+typedef struct ModuleEntry
+{
+	uint64_t _start;
+	uint64_t _end;   // last byte (inclusive), as written by Ablation
+	string _name;
+	string _path;
+} ModuleEntry;
+
+/// <summary>
+/// Everything parsed from one chunk of the input. JSON is rendered by the worker so the writer only has to copy it.
+/// </summary>
+typedef struct ChunkResult
+{
+	string _json;
+	vector<ModuleEntry> _modules;
+	vector<string> _targets;
+	vector<pair<uint32_t, uint32_t> > _blocks;
+	uint64_t _records;
+} ChunkResult;
+
+/// <summary>
+/// Command line options.
+/// </summary>
+typedef struct Options
+{
+	string _input;
+	string _outputBase;
+	string _module;
+	bool _drcov;
+	bool _json;
+	unsigned _threads;
+	size_t _chunkSize;
+} Options;
+
+/// <summary>
+/// Checks whether line starts with prefix.
+/// </summary>
+static bool StartsWith(const char *line, size_t len, const char *prefix, size_t prefixLen)
+{
+	return len >= prefixLen && memcmp(line, prefix, prefixLen) == 0;
+}
+
+/// <summary>
+/// Parses a number (hex with 0x prefix, otherwise decimal) and skips the following separator.
+/// </summary>
+/// <param name="p">The parse position, advanced past the number and separator.</param>
+/// <param name="end">The end of the line.</param>
+/// <param name="value">The parsed value.</param>
+/// <returns>true if a number was parsed.</returns>
+static bool ParseNumber(const char *&p, const char *end, uint64_t &value)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+
+	if (p >= end || !isxdigit((unsigned char)*p))
+		return false;
+
+	char *next;
+	value = strtoull(p, &next, 0);
+	p = next;
+
+	while (p < end && (*p == ' ' || *p == ','))
+		p++;
+
+	return true;
+}
+
+/// <summary>
+/// Parses a double quoted string argument and skips the following separator.
+/// </summary>
+static bool ParseString(const char *&p, const char *end, string &value)
+{
+	while (p < end && *p == ' ')
+		p++;
+
+	if (p >= end || *p != '"')
+		return false;
+
+	const char *start = ++p;
+	while (p < end && *p != '"')
+		p++;
+
+	if (p >= end)
+		return false;
+
+	value.assign(start, p - start);
+	p++;
+
+	while (p < end && (*p == ' ' || *p == ','))
+		p++;
+
+	return true;
+}
+
+/// <summary>
+/// Appends s to json as an escaped JSON string.
+/// </summary>
+static void AppendJsonString(string &json, const string &s)
+{
+	json += '"';
+	for (size_t i = 0; i < s.length(); i++)
+	{
+		char c = s[i];
+		if (c == '"' || c == '\\')
+		{
+			json += '\\';
+			json += c;
+		}
+		else if ((unsigned char)c < 0x20)
+		{
+			char buf[8];
+			sprintf(buf, "\\u%04x", c);
+			json += buf;
+		}
+		else
+		{
+			json += c;
+		}
+	}
+	json += '"';
+}
+
+/// <summary>
+/// Counts a new record and, when rendering JSON, appends ",\n    {" and its "type" member.
+/// </summary>
+/// <returns>false if JSON is not rendered, so the caller skips the members.</returns>
+static bool BeginRecord(ChunkResult &r, const char *type, bool json)
+{
+	r._records++;
+	if (!json)
+		return false;
+
+	r._json += ",\n    {\"type\": \"";
+	r._json += type;
+	r._json += "\"";
+	return true;
+}
+
+/// <summary>
+/// Appends a numeric member to the current JSON record.
+/// </summary>
+static void AppendMember(ChunkResult &r, const char *name, uint64_t value)
+{
+	char buf[64];
+	sprintf(buf, ", \"%s\": %llu", name, (unsigned long long)value);
+	r._json += buf;
+}
+
+/// <summary>
+/// Parses a single line of Ablation output. Lines that are not records (script header, comments) are ignored.
+/// </summary>
+/// <param name="json">Render the JSON record, otherwise only the drcov data is kept.</param>
+static void ParseLine(const char *line, size_t len, bool json, ChunkResult &r)
+{
+	static const char mark[] = "mark(";
+	static const char hot[] = "hot(";
+	static const char xref[] = "createXRef(";
+	static const char xrefExternal[] = "createXRefExternal(";
+	static const char callEdge[] = "createCallEdge(";
+	static const char callEdgeExternal[] = "createCallEdgeExternal(";
+	static const char moduleLine[] = "# MODULE: ";
+	static const char targetLine[] = "# TARGET: ";
+
+	const char *end = line + len;
+	const char *p;
+	uint64_t a, b, c, d;
+	string s;
+
+	if (StartsWith(line, len, mark, sizeof(mark) - 1))
+	{
+		p = line + sizeof(mark) - 1;
+		if (!ParseNumber(p, end, a))
+			return;
+		if (!ParseNumber(p, end, b))
+			b = 0;
+
+		r._blocks.push_back(make_pair((uint32_t)a, (uint32_t)b));
+
+		if (!BeginRecord(r, "block", json))
+			return;
+
+		AppendMember(r, "offset", a);
+		AppendMember(r, "size", b);
+		r._json += "}";
+	}
+	else if (StartsWith(line, len, hot, sizeof(hot) - 1))
+	{
+		p = line + sizeof(hot) - 1;
+		if (!ParseNumber(p, end, a))
+			return;
+		if (!ParseNumber(p, end, b))
+			b = 0;
+
+		if (!BeginRecord(r, "hot", json))
+			return;
+
+		AppendMember(r, "offset", a);
+		AppendMember(r, "size", b);
+		r._json += "}";
+	}
+	else if (StartsWith(line, len, xref, sizeof(xref) - 1))
+	{
+		p = line + sizeof(xref) - 1;
+		if (!ParseNumber(p, end, a) || !ParseNumber(p, end, b))
+			return;
+
+		if (!BeginRecord(r, "xref", json))
+			return;
+
+		AppendMember(r, "caller", a);
+		AppendMember(r, "target", b);
+		r._json += "}";
+	}
+	else if (StartsWith(line, len, xrefExternal, sizeof(xrefExternal) - 1))
+	{
+		p = line + sizeof(xrefExternal) - 1;
+		if (!ParseNumber(p, end, a) || !ParseString(p, end, s))
+			return;
+
+		if (!BeginRecord(r, "xref_external", json))
+			return;
+
+		AppendMember(r, "caller", a);
+		r._json += ", \"target\": ";
+		AppendJsonString(r._json, s);
+		r._json += "}";
+	}
+	else if (StartsWith(line, len, callEdge, sizeof(callEdge) - 1))
+	{
+		p = line + sizeof(callEdge) - 1;
+		if (!ParseNumber(p, end, a) || !ParseNumber(p, end, b) || !ParseNumber(p, end, c) || !ParseNumber(p, end, d))
+			return;
+
+		if (!BeginRecord(r, "call_edge", json))
+			return;
+
+		AppendMember(r, "caller", a);
+		AppendMember(r, "target", b);
+		AppendMember(r, "calls", c);
+		AppendMember(r, "inclusive", d);
+		r._json += "}";
+	}
+	else if (StartsWith(line, len, callEdgeExternal, sizeof(callEdgeExternal) - 1))
+	{
+		p = line + sizeof(callEdgeExternal) - 1;
+		if (!ParseNumber(p, end, a) || !ParseString(p, end, s) || !ParseNumber(p, end, c) || !ParseNumber(p, end, d))
+			return;
+
+		if (!BeginRecord(r, "call_edge_external", json))
+			return;
+
+		AppendMember(r, "caller", a);
+		r._json += ", \"target\": ";
+		AppendJsonString(r._json, s);
+		AppendMember(r, "calls", c);
+		AppendMember(r, "inclusive", d);
+		r._json += "}";
+	}
+	else if (StartsWith(line, len, moduleLine, sizeof(moduleLine) - 1))
+	{
+		// # MODULE: 0xstart 0xend "name" path, the path runs to the end of the line
+		ModuleEntry entry;
+		p = line + sizeof(moduleLine) - 1;
+		if (!ParseNumber(p, end, entry._start) || !ParseNumber(p, end, entry._end) || !ParseString(p, end, entry._name))
+			return;
+
+		entry._path = p < end ? string(p, end - p) : entry._name;
+
+		r._modules.push_back(entry);
+
+		if (!BeginRecord(r, "module", json))
+			return;
+
+		AppendMember(r, "start", entry._start);
+		AppendMember(r, "end", entry._end);
+		r._json += ", \"name\": ";
+		AppendJsonString(r._json, entry._name);
+		r._json += ", \"path\": ";
+		AppendJsonString(r._json, entry._path);
+		r._json += "}";
+	}
+	else if (StartsWith(line, len, targetLine, sizeof(targetLine) - 1))
+	{
+		s.assign(line + sizeof(targetLine) - 1, len - (sizeof(targetLine) - 1));
+		r._targets.push_back(s);
+
+		if (!BeginRecord(r, "target", json))
+			return;
+
+		r._json += ", \"name\": ";
+		AppendJsonString(r._json, s);
+		r._json += "}";
+	}
+}
+
+/// <summary>
+/// Parses a chunk of whole lines. Runs on a worker thread.
+/// </summary>
+/// <param name="text">The chunk.</param>
+/// <param name="json">Render JSON records.</param>
+static ChunkResult ParseChunk(string text, bool json)
+{
+	ChunkResult r;
+	r._records = 0;
+
+	const char *p = text.data();
+	const char *end = p + text.length();
+
+	while (p < end)
+	{
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if (eol == 0)
+			eol = end;
+
+		size_t len = eol - p;
+		if (len > 0 && p[len - 1] == '\r')
+			len--;
+
+		ParseLine(p, len, json, r);
+		p = eol + 1;
+	}
+
+
+	return r;
+}
+
+/// <summary>
+/// Accumulates chunk results in input order and streams the JSON records.
+/// </summary>
+class Collector
+{
+public:
+	Collector(ostream *json) : _json(json), _first(true), _records(0), _blockRecords(0) {}
+
+	void Add(ChunkResult &r)
+	{
+		if (_json && !r._json.empty())
+		{
+			// Every record is prefixed with a separator, drop the one in front of the very first record
+			*_json << (_first ? r._json.substr(2) : r._json);
+			_first = false;
+		}
+
+		for (size_t i = 0; i < r._modules.size(); i++)
+		{
+			bool known = false;
+			for (size_t j = 0; j < _modules.size() && !known; j++)
+				known = _modules[j]._name == r._modules[i]._name;
+
+			if (!known)
+				_modules.push_back(r._modules[i]);
+		}
+
+		_targets.insert(_targets.end(), r._targets.begin(), r._targets.end());
+
+		for (size_t i = 0; i < r._blocks.size(); i++)
+		{
+			uint32_t &size = _blocks[r._blocks[i].first];
+			if (r._blocks[i].second > size)
+				size = r._blocks[i].second;
+		}
+
+		_records += r._records;
+		_blockRecords += r._blocks.size();
+	}
+
+	ostream *_json;
+	bool _first;
+	uint64_t _records;
+	uint64_t _blockRecords;
+	vector<ModuleEntry> _modules;
+	vector<string> _targets;
+	map<uint32_t, uint32_t> _blocks; // offset -> size, unique across appended runs
+};
+
+/// <summary>
+/// Finds the instrumented module: -m, then the first "# TARGET:" line, then the output file name prefix (module.ablation...).
+/// </summary>
+static string TargetModule(const Options &options, const Collector &collector)
+{
+	if (!options._module.empty())
+		return options._module;
+
+	if (!collector._targets.empty())
+		return collector._targets[0];
+
+	size_t slash = options._input.find_last_of("/\\");
+	string name = slash == string::npos ? options._input : options._input.substr(slash + 1);
+	return name.substr(0, name.find('.'));
+}
+
+/// <summary>
+/// Writes the drcov file. Blocks all belong to the instrumented module, other modules are listed so Lighthouse can match names.
+/// </summary>
+static bool WriteDrcov(const string &filename, const Options &options, Collector &collector)
+{
+	FILE *f = fopen(filename.c_str(), "wb");
+	if (f == 0)
+	{
+		cerr << "Error: could not create " << filename << endl;
+		return false;
+	}
+
+	string target = TargetModule(options, collector);
+
+	size_t targetId = collector._modules.size();
+	for (size_t i = 0; i < collector._modules.size(); i++)
+	{
+		if (collector._modules[i]._name == target)
+		{
+			targetId = i;
+			break;
+		}
+	}
+
+	if (targetId == collector._modules.size())
+	{
+		// No module table (older output), describe the module from the blocks
+		ModuleEntry entry;
+		entry._start = 0;
+		entry._end = collector._blocks.empty() ? 0 : collector._blocks.rbegin()->first + collector._blocks.rbegin()->second - 1;
+		entry._name = target;
+		entry._path = target;
+		collector._modules.push_back(entry);
+
+		cerr << "Warning: no module table for " << target << ", using offsets as is" << endl;
+	}
+
+	fprintf(f, "DRCOV VERSION: 2\n");
+	fprintf(f, "DRCOV FLAVOR: drcov\n");
+	fprintf(f, "Module Table: version 2, count %u\n", (unsigned)collector._modules.size());
+	fprintf(f, "Columns: id, base, end, entry, checksum, timestamp, path\n");
+
+	// drcov module ends are exclusive
+	for (size_t i = 0; i < collector._modules.size(); i++)
+	{
+		const ModuleEntry &mod = collector._modules[i];
+		fprintf(f, "%3u, 0x%016llx, 0x%016llx, 0x%016llx, 0x%08x, 0x%08x, %s\n",
+			(unsigned)i, (unsigned long long)mod._start, (unsigned long long)(mod._end + 1), 0ULL, 0, 0, mod._path.c_str());
+	}
+
+	fprintf(f, "BB Table: %u bbs\n", (unsigned)collector._blocks.size());
+
+	// struct { uint32 start; uint16 size; uint16 id; }, little endian
+	vector<unsigned char> table;
+	table.reserve(collector._blocks.size() * 8);
+	for (map<uint32_t, uint32_t>::const_iterator it = collector._blocks.begin(); it != collector._blocks.end(); ++it)
+	{
+		uint32_t start = it->first;
+		uint16_t size = (uint16_t)(it->second == 0 ? 1 : (it->second > 0xFFFF ? 0xFFFF : it->second));
+		uint16_t id = (uint16_t)targetId;
+
+		unsigned char entry[8] = {
+			(unsigned char)start, (unsigned char)(start >> 8), (unsigned char)(start >> 16), (unsigned char)(start >> 24),
+			(unsigned char)size, (unsigned char)(size >> 8),
+			(unsigned char)id, (unsigned char)(id >> 8)
+		};
+		table.insert(table.end(), entry, entry + sizeof(entry));
+	}
+
+	if (!table.empty())
+		fwrite(&table[0], 1, table.size(), f);
+
+	fclose(f);
+	return true;
+}
+
+/// <summary>
+/// Outputs the usage summary.
+/// </summary>
+/// <returns>-1</returns>
+static int Usage()
+{
+	cerr << "Usage:" << endl << "\tAblationConvert [options] <ablation output>" << endl << endl;
+	cerr << "\t-f <drcov|json|all>   Output format (default all)." << endl;
+	cerr << "\t-o <base>             Output file name without extension (default: input without extension)." << endl;
+	cerr << "\t-m <module>           Module the blocks belong to (default: from the output)." << endl;
+	cerr << "\t-j <threads>          Parser threads (default: number of cores)." << endl;
+	cerr << "\t-c <MB>               Chunk size in MB handed to each parser (default 16)." << endl;
+	return -1;
+}
+
+/// <summary>
+/// Parses the command line.
+/// </summary>
+static bool ParseOptions(int argc, char *argv[], Options &options)
+{
+	options._drcov = true;
+	options._json = true;
+	options._threads = thread::hardware_concurrency();
+	options._chunkSize = 16 << 20;
+
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+
+		if (arg[0] != '-')
+		{
+			options._input = arg;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+			return false;
+
+		string value = argv[++i];
+
+		if (arg == "-f")
+		{
+			options._drcov = value == "drcov" || value == "all";
+			options._json = value == "json" || value == "all";
+			if (!options._drcov && !options._json)
+				return false;
+		}
+		else if (arg == "-o")
+			options._outputBase = value;
+		else if (arg == "-m")
+			options._module = value;
+		else if (arg == "-j")
+			options._threads = (unsigned)atoi(value.c_str());
+		else if (arg == "-c")
+			options._chunkSize = (size_t)atoi(value.c_str()) << 20;
+		else
+			return false;
+	}
+
+	if (options._threads == 0)
+		options._threads = 1;
+	if (options._chunkSize == 0)
+		options._chunkSize = 1 << 20;
+
+	if (options._outputBase.empty())
+		options._outputBase = options._input.substr(0, options._input.find_last_of('.'));
+
+	return !options._input.empty();
+}
+
+/// <summary>
+/// Main. The input is read in chunks cut at line boundaries, chunks are parsed in parallel and collected in order,
+/// so the JSON output is streamed while at most a few chunks per thread are in memory.
+/// </summary>
+int main(int argc, char *argv[])
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+		return Usage();
+
+	ifstream in(options._input.c_str(), ios::in | ios::binary);
+	if (!in)
+	{
+		cerr << "Error: could not open " << options._input << endl;
+		return -1;
+	}
+
+	ofstream *json = 0;
+	if (options._json)
+	{
+		json = new ofstream((options._outputBase + ".json").c_str(), ios::out | ios::binary | ios::trunc);
+		*json << "{\n  \"format\": \"ablation\",\n  \"version\": 1,\n  \"records\": [\n";
+	}
+
+	Collector collector(json);
+	deque<future<ChunkResult> > pending;
+	string carry;
+	vector<char> buffer(options._chunkSize);
+
+	while (in)
+	{
+		in.read(&buffer[0], buffer.size());
+		size_t read = (size_t)in.gcount();
+		if (read == 0)
+			break;
+
+		// Hand over whole lines only, the partial last line starts the next chunk
+		size_t cut = read;
+		while (cut > 0 && buffer[cut - 1] != '\n')
+			cut--;
+
+		// A line longer than the chunk, keep collecting it
+		if (cut == 0)
+		{
+			carry.append(&buffer[0], read);
+			continue;
+		}
+
+		string text;
+		text.reserve(carry.length() + cut);
+		text.append(carry);
+		text.append(&buffer[0], cut);
+		carry.assign(&buffer[cut], read - cut);
+
+		if (text.empty())
+			continue;
+
+		pending.push_back(async(launch::async, ParseChunk, std::move(text), options._json));
+
+		// Bound memory, and keep the output in input order
+		if (pending.size() >= options._threads * 2)
+		{
+			ChunkResult r = pending.front().get();
+			pending.pop_front();
+			collector.Add(r);
+		}
+	}
+
+	if (!carry.empty())
+		pending.push_back(async(launch::async, ParseChunk, std::move(carry), options._json));
+
+	while (!pending.empty())
+	{
+		ChunkResult r = pending.front().get();
+		pending.pop_front();
+		collector.Add(r);
+	}
+
+	if (json)
+	{
+		*json << "\n  ],\n  \"summary\": {\"records\": " << collector._records
+			<< ", \"blocks\": " << collector._blockRecords
+			<< ", \"unique_blocks\": " << collector._blocks.size()
+			<< ", \"target\": ";
+		string target;
+		AppendJsonString(target, TargetModule(options, collector));
+		*json << target << "}\n}\n";
+		json->close();
+		delete json;
+	}
+
+	if (options._drcov && !WriteDrcov(options._outputBase + ".drcov", options, collector))
+		return -1;
+
+	cout << collector._records << " records, " << collector._blocks.size() << " unique blocks" << endl;
+	return 0;
+}